@@ -2,8 +2,10 @@
 //a simple roguelike demo using rlutil
 //chang from a c program
 
+#define RLUTIL_USE_ANSI // draw() builds ANSI frames; Windows 10+ consoles take them
 #include "rlutil.h"
-#include <stdlib.h> // for srand() / rand()
+#include "rlenv.h"
+#include <stdlib.h>
 #include <stdio.h>
 #include "math.h"
 #include <chrono>
@@ -14,6 +16,32 @@
 #include <deque>
 #include <string>
 #include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <csignal>
+#include <atomic>
+#include <new>
+#include <optional>
+#include <memory_resource>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 using namespace rlutil;
 
@@ -26,30 +54,383 @@ using namespace rlutil;
 #define WALL 1
 #define COIN (1 << 1)
 #define STAIRS_DOWN (1 << 2)
+#define STAIRS_UP (1 << 3)   // '<' here climbs back to the level above
 #define TORCH (1 << 4)
 #define POTION (1 << 5)
 #define SWORD_ITEM (1 << 6)
+#define ENEMY_MARK (1 << 7) // render-only overlay, never stored in lvl
 
-#define MAPSIZE 15
+typedef uint8_t tile_t;
+
+#define MAPSIZE 15 // default map width and height
+#define MAP_MAX 64  // largest --mapsize
+
+/// Random numbers
+// splitmix64 step, used to derive per-level seeds and as the game RNG
+uint64_t mix64(uint64_t v) {
+	v += 0x9E3779B97F4A7C15ULL;
+	v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	v = (v ^ (v >> 27)) * 0x94D049BB133111EBULL;
+	return v ^ (v >> 31);
+}
+
+// Game randomness comes from per-thread streams, one per subsystem, so map
+// generation and combat draw independently. A stream is counter-based: draw i
+// is splitmix64's output for step i from the stream's key, so its whole state
+// is 16 bytes that undo, the level pack and batch environments copy as is.
+// rnd(s, n) maps draws onto [0, n) without modulo bias.
+struct RngStream {
+	uint64_t key;
+	uint64_t pos; // draws taken
+};
+
+thread_local RngStream gen_rng;    // levels: terrain, items, spawns
+thread_local RngStream combat_rng; // turns: attacks, enemy choices, loot
+
+void seed_stream(RngStream &s, uint64_t seed) {
+	s.key = mix64(seed);
+	s.pos = 0;
+}
+
+void seed_rng(uint64_t s) {
+	seed_stream(gen_rng, s);
+	seed_stream(combat_rng, s ^ 0xC0BA7ULL);
+}
+
+inline uint32_t rng_next(RngStream &s) {
+	return (uint32_t)(mix64(s.key + s.pos++ * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+// Uniform in [0, n); 0 when n <= 1. Lemire's multiply-shift: the high half
+// of draw * n, redrawn in the rare low-half window that would bias it. That
+// window's bound is the only division, and it is reached about n / 2^32 of
+// the time, so the common path is one multiply and a predictable branch.
+inline int rnd(RngStream &s, int n) {
+	if (n <= 1) return 0;
+	uint64_t m = (uint64_t)rng_next(s) * (uint32_t)n;
+	if ((uint32_t)m < (uint32_t)n) {
+		uint32_t t = (0u - (uint32_t)n) % (uint32_t)n; // 2^32 mod n
+		while ((uint32_t)m < t) m = (uint64_t)rng_next(s) * (uint32_t)n;
+	}
+	return (int)(m >> 32);
+}
+
+/// Item and enemy definitions
+// Everything a designer tunes lives in the tables below; the turn loop only
+// indexes them. A Curve rolls base + rnd(span + level/per_level), gated by
+// a chance in percent (100 = always rolls).
+struct Curve {
+	int base;
+	int span;
+	int per_level; // 0 = no level scaling
+	int chance;
+};
+
+constexpr int curve_span(const Curve &c, int lv) {
+	return c.span + (c.per_level ? lv / c.per_level : 0);
+}
+
+int roll(const Curve &c, int lv, RngStream &s) {
+	if (c.chance < 100 && rnd(s, 100) >= c.chance) return 0;
+	return c.base + rnd(s, curve_span(c, lv));
+}
+
+enum ItemEffect { EFFECT_COINS, EFFECT_TORCH, EFFECT_POTION, EFFECT_SWORD };
+
+struct ItemDef {
+	int tile;          // tile flag carrying the item
+	ItemEffect effect; // which player stat the pickup feeds
+	Curve amount;      // rolled on pickup
+	int spawn_weight;  // chance in percent per scatter try in gen()
+	const char *msg;   // pickup message, gets the rolled amount
+};
+
+constexpr ItemDef item_defs[] = {
+	{ COIN,       EFFECT_COINS,  { 1, 0, 0, 100}, 5, "You gain %d coins." },
+	{ TORCH,      EFFECT_TORCH,  {20, 0, 0, 100}, 3, "You found torch +%d." },
+	{ POTION,     EFFECT_POTION, { 1, 0, 0, 100}, 2, "You found a potion." },
+	{ SWORD_ITEM, EFFECT_SWORD,  { 1, 2, 0, 100}, 2, "You found a sword (+%d attack)." },
+};
+constexpr int ITEM_COUNT = sizeof(item_defs) / sizeof(item_defs[0]);
+constexpr int ITEM_TILES = COIN | TORCH | POTION | SWORD_ITEM;
+
+struct EnemyArchetype {
+	const char *name;
+	int min_level;    // first level it may spawn on
+	int spawn_weight; // relative weight among archetypes allowed on a level
+	Curve hp, damage;
+	// drop table, rolled at spawn so the HUD can show it
+	Curve coins, potions, torch, heal;
+};
+
+constexpr EnemyArchetype enemy_defs[] = {
+	{ "enemy", 1, 1,
+	  {2, 3, 1, 100}, {1, 1, 2, 100},
+	  {1, 2, 2, 100}, {1, 0, 0, 10}, {0, 3, 2, 100}, {1, 1, 2, 100} },
+};
+constexpr int ENEMY_KINDS = sizeof(enemy_defs) / sizeof(enemy_defs[0]);
+constexpr Curve enemy_count_curve = {0, 1, 1, 100}; // 0..level enemies per level
+
+template <int N> struct ItemLookup { signed char item[N]; };
+
+// rnd(100) -> item_defs index (-1 = leave floor empty) for the scatter pass
+constexpr ItemLookup<100> make_spawn_roll() {
+	ItemLookup<100> t = {};
+	int r = 0;
+	for (int i = 0; i < ITEM_COUNT; i++)
+		for (int w = 0; w < item_defs[i].spawn_weight && r < 100; w++) t.item[r++] = (signed char)i;
+	while (r < 100) t.item[r++] = -1;
+	return t;
+}
+constexpr ItemLookup<100> spawn_roll = make_spawn_roll();
+
+/// Tile table
+// One entry per tile byte: what draw() prints and what stepping onto it does.
+// Flags resolve in the same priority the old if/else chains used.
+enum TileAction { ACT_NONE, ACT_BLOCK, ACT_ITEM, ACT_DESCEND, ACT_ASCEND };
+
+struct TileLook {
+	char glyph;
+	unsigned char color;
+	unsigned char action; // TileAction
+	signed char item;     // item_defs index, -1 = none
+};
+
+struct TileTable { TileLook look[256]; };
+
+constexpr TileTable make_tile_table() {
+	TileTable t = {};
+	for (int v = 0; v < 256; v++) {
+		TileLook &l = t.look[v];
+		l.glyph = '.'; l.color = BLUE; l.action = ACT_NONE; l.item = -1;
+		for (int i = ITEM_COUNT - 1; i >= 0; i--)
+			if (v & item_defs[i].tile) { l.item = (signed char)i; l.action = ACT_ITEM; }
+		if (v & STAIRS_UP && l.item == -1) l.action = ACT_ASCEND;
+		if (v & STAIRS_DOWN && l.item == -1) l.action = ACT_DESCEND;
+		if (v & WALL) { l.action = ACT_BLOCK; l.item = -1; }
+
+		if (v & ENEMY_MARK) { l.glyph = 'E'; l.color = RED; }
+		else if (v & WALL) { l.glyph = '#'; l.color = CYAN; }
+		else if (v & COIN) { l.glyph = 'o'; l.color = YELLOW; }
+		else if (v & STAIRS_DOWN) { l.glyph = '>'; l.color = GREEN; }
+		else if (v & STAIRS_UP) { l.glyph = '<'; l.color = LIGHTGREEN; }
+		else if (v & TORCH) { l.glyph = 'f'; l.color = LIGHTRED; }
+		else if (v & POTION) { l.glyph = 'P'; l.color = MAGENTA; }
+		else if (v & SWORD_ITEM) { l.glyph = 'S'; l.color = LIGHTCYAN; }
+	}
+	return t;
+}
+constexpr TileTable tile_table = make_tile_table();
+
+/// Heap accounting
+// With -DGAME_HEAP_STATS, counts general-purpose allocations so --bench-gen
+// can show that level generation has stopped touching the heap once the arena
+// has warmed up. Other builds, the library included, keep the stock operator
+// new.
+std::atomic<long long> heap_allocs{0};
+
+#if defined(GAME_HEAP_STATS) && !defined(GAME_NO_MAIN)
+void *operator new(size_t n) {
+	heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = malloc(n ? n : 1)) return p;
+	throw std::bad_alloc();
+}
+// Kept out of line: once inlined, GCC pairs the free() with a plain new
+// expression and warns about a mismatch that is not there
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+void operator delete(void *p) noexcept { free(p); }
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
+
+/// Level arena
+// Everything scoped to one level (tile grid, enemies, per-level buffers and
+// scratch) is bump-allocated from level_arena and dropped at once by reset()
+// when a new level starts. Individual frees are no-ops. The first block grows
+// to the largest level seen, so after warm-up a level never reaches upstream.
+// level_arena points at the thread's own arena, or at a batch environment's
+// while that environment steps; containers allocate through arena_router so
+// they can be swapped between environments.
+struct CountingResource : std::pmr::memory_resource {
+	long long allocs = 0;
+	void *do_allocate(size_t n, size_t align) override {
+		allocs++;
+		return std::pmr::new_delete_resource()->allocate(n, align);
+	}
+	void do_deallocate(void *p, size_t n, size_t align) override {
+		std::pmr::new_delete_resource()->deallocate(p, n, align);
+	}
+	bool do_is_equal(const std::pmr::memory_resource &o) const noexcept override { return this == &o; }
+};
+
+class LevelArena : public std::pmr::memory_resource {
+public:
+	LevelArena() { mono.emplace(&upstream); }
+
+	// Forget everything allocated since the last reset; O(1) once warmed up
+	void reset() {
+		if (upstream.allocs > spills_seen && used > block.size())
+			block.resize(used + used / 4); // grow the first block past the high-water mark
+		spills_seen = upstream.allocs;
+		if (block.empty()) mono.emplace(&upstream);
+		else mono.emplace(block.data(), block.size(), &upstream);
+		used = 0;
+	}
+
+	size_t bytes_used() const { return used; }
+	size_t block_size() const { return block.size(); }
+	long long spills() const { return upstream.allocs; }
+
+private:
+	std::vector<char> block;
+	CountingResource upstream;
+	std::optional<std::pmr::monotonic_buffer_resource> mono;
+	size_t used = 0;
+	long long spills_seen = 0;
+
+	void *do_allocate(size_t n, size_t align) override {
+		used += n + align;
+		return mono->allocate(n, align);
+	}
+	void do_deallocate(void *, size_t, size_t) override {} // freed by reset()
+	bool do_is_equal(const std::pmr::memory_resource &o) const noexcept override { return this == &o; }
+};
+
+thread_local LevelArena own_arena;
+thread_local LevelArena *level_arena = &own_arena;
+
+// Forwards to whichever arena is current
+struct ArenaRouter : std::pmr::memory_resource {
+	void *do_allocate(size_t n, size_t align) override { return level_arena->allocate(n, align); }
+	void do_deallocate(void *p, size_t n, size_t align) override { level_arena->deallocate(p, n, align); }
+	bool do_is_equal(const std::pmr::memory_resource &o) const noexcept override { return this == &o; }
+};
+thread_local ArenaRouter arena_router;
+
+// Uninitialized array of n T from the current level; valid until the next gen()
+template <class T> T *level_alloc(size_t n) {
+	return static_cast<T *>(level_arena->allocate(n * sizeof(T), alignof(T)));
+}
+
+/// Map dimensions
+// The map is a flat column-major array: tile (x, y) lives at x * stride + y.
+// It is surrounded by a ring of sentinel WALL cells (x or y of -1, w or h),
+// so the four neighbours of any map cell are lvl[i +- 1] and lvl[i +- stride]
+// with no bounds check; a column's bottom sentinel doubles as the next
+// column's top one, hence stride >= h + 1.
+// Map algorithms are templates over a dimension policy. StaticDims fixes the
+// size at compile time and pads the stride to a power of two, so an index is
+// a shift and an add and loop trip counts are constants. DynamicDims reads
+// the current map size and covers everything else. with_dims() picks the
+// instantiation once per call.
+int map_w = MAPSIZE, map_h = MAPSIZE; // current map size (--mapsize)
+thread_local int map_stride = MAPSIZE + 1; // distance between columns in lvl
+bool opt_dynamic_dims = false;        // always take the DynamicDims path
+
+constexpr int pow2_ceil(int v) { int p = 1; while (p < v) p <<= 1; return p; }
+constexpr int log2_of(int p) { int s = 0; while ((1 << s) < p) s++; return s; }
+
+template <int W, int H>
+struct StaticDims {
+	static constexpr int shift = log2_of(pow2_ceil(H + 1));
+	static constexpr int w() { return W; }
+	static constexpr int h() { return H; }
+	static constexpr int stride() { return 1 << shift; }
+	static int at(int px, int py) { return (px << shift) + py; }
+	// not on the outer wall ring
+	static bool interior(int px, int py) { return (unsigned)(px - 1) < (unsigned)(W - 2) && (unsigned)(py - 1) < (unsigned)(H - 2); }
+};
+
+struct DynamicDims {
+	static int w() { return map_w; }
+	static int h() { return map_h; }
+	static int stride() { return map_h + 1; }
+	static int at(int px, int py) { return px * map_stride + py; }
+	static bool interior(int px, int py) { return (unsigned)(px - 1) < (unsigned)(map_w - 2) && (unsigned)(py - 1) < (unsigned)(map_h - 2); }
+};
+
+// Call f(Dims()) with the specialization for the current map size, if any
+template <class F> void with_dims(F &&f) {
+	if (!opt_dynamic_dims && map_w == map_h) {
+		switch (map_w) {
+			case 15: f(StaticDims<15, 15>()); return;
+			case 16: f(StaticDims<16, 16>()); return;
+			case 32: f(StaticDims<32, 32>()); return;
+			case 64: f(StaticDims<64, 64>()); return;
+		}
+	}
+	f(DynamicDims());
+}
 
 /// Globals
-int x, y;
-int coins = 0, moves = 0, torch = 30, level = 1;
-int lvl[MAPSIZE][MAPSIZE];
+// Game state is thread_local: --simulate plays one game per worker thread.
+thread_local int x, y;
+thread_local int coins = 0, moves = 0, torch = 30, level = 1;
+thread_local int deepest_level = 1; // score and achievements count depth reached, not the level stood on
+thread_local tile_t *lvl; // tile (0, 0) of the sentinel-bordered grid in level_arena
+
+// Tile access outside the templated map code
+inline tile_t &tile(int px, int py) { return lvl[px * map_stride + py]; }
 
 // Combat & items
-int potions = 0;           // current potion count
-int potions_used = 0;      // for summary
-int swordDamage = 2;      // base attack
-int max_hp = 20;
-int hp = 20;
-int kills = 0; // total enemies defeated
-bool player_defending = false;
+thread_local int potions = 0;           // current potion count
+thread_local int potions_used = 0;      // for summary
+thread_local int swordDamage = 2;      // base attack
+thread_local int max_hp = 20;
+thread_local int hp = 20;
+thread_local int kills = 0; // total enemies defeated
+thread_local bool player_defending = false;
+thread_local int enemies_noticed = 0; // enemies that have become active so far
 
 // End game reason
-std::string game_end_reason = "";
+thread_local std::string game_end_reason = "";
+enum EndCode { END_QUIT, END_TORCH, END_KILLED };
+thread_local int game_end_code = END_QUIT;
+
+// Run seed: each level is generated from (run_seed, level number)
+thread_local uint64_t run_seed = 0;
+
+// Options (see parse_args)
+bool opt_realtime = false; // world advances on a fixed tick instead of per key
+int opt_tick_hz = 10;      // fixed simulation tick rate in real-time mode
+int opt_turn_ticks = 5;    // ticks per world turn (enemies act, torch burns)
+int opt_fps = 30;          // render cap in real-time mode
+int opt_min_fps = 20;      // turn-based: draw at least this often while input piles up
+int opt_enemies = -1;      // force this many enemies per level (-1 = table)
+int opt_bench_gen = 0;     // generate this many levels, report and exit
+bool opt_seed_given = false;
+bool opt_history = true;   // record finished runs in the run history
+std::string opt_history_path = "runs"; // run history file prefix
+int opt_scores = 0;        // print this many leaderboard entries and exit
+long long opt_simulate = 0; // play this many bot runs, print per-level CSV and exit
+int opt_threads = 0;       // simulation workers (0 = one per core)
+int opt_sim_levels = 50;   // a simulated run that clears this level counts as a full descent
+std::string opt_csv_path;  // simulation CSV goes here instead of stdout
+bool opt_no_intro = false; // skip the title screens
+int opt_bench_latency = 0; // time this many keystrokes through a pty, report and exit
+std::string opt_latency_keys = "dasw"; // keys cycled by the latency harness
+std::string opt_telemetry_path; // write the event stream here (empty = off)
+bool opt_telemetry_json = false; // NDJSON instead of packed binary records
+bool opt_perf = false;     // count hardware events per game phase
+enum GenKind { GEN_CAVE, GEN_BSP, GEN_KINDS, GEN_MIXED = GEN_KINDS };
+const char *gen_names[GEN_KINDS] = { "cave", "bsp" };
+int opt_gen = GEN_CAVE;    // level generator, or GEN_MIXED to alternate per level
+std::string opt_pack_path; // load levels from / save levels to this pack
+int opt_undo_depth = 100;  // turns 'u' can step back (0 = off)
+int opt_level_store_kb = -1; // cap on the levels kept for going back up (0 = off,
+                              // -1 = 1024, or off for bots, which never climb: --simulate,
+                              // --bench-batch and the library build)
+int opt_spectate_port = 0; // stream frames to viewers on this local port (0 = off)
+int opt_bench_batch = 0;   // step this many batch environments, report and exit
+std::string opt_build_pack; // fill this pack with levels, report and exit
+int opt_pack_levels = 50;  // levels per seed for --build-pack
 
 struct Enemy {
+	int kind; // index into enemy_defs
 	int x, y;
 	int hp;
 	int max_hp;
@@ -64,7 +445,7 @@ struct Enemy {
 	int hp_drop;
 };
 
-std::vector<Enemy> enemies;
+thread_local std::pmr::vector<Enemy> enemies(&arena_router);
 
 // Helper forward declarations
 int enemy_at(int px, int py); // returns index in enemies or -1
@@ -72,48 +453,712 @@ int adjacent_enemy_index();
 void process_enemies_turn();
 void drop_loot(int enemy_index);
 
-// Message log (newest on top), limited to 14 entries
-std::deque<std::string> msglog;
+// Terminal mode: alternate screen, synchronized frames and a scrolled log
+bool term_alt = false;         // alternate screen + scroll-region log in use
+bool term_sync = false;        // terminal understands DEC mode 2026
+bool full_redraw = true;       // next draw() repaints the whole screen
+thread_local unsigned long msg_count = 0; // messages pushed so far
+unsigned long msg_drawn = 0;   // messages already on screen
+
+// Message log (newest on top), limited to 14 entries.
+// A fixed ring of lines, so logging never allocates.
+#define MSGLOG_LINES 14
+struct MsgLog {
+	char line[MSGLOG_LINES][128];
+	int head = 0, count = 0;
+	size_t size() const { return (size_t)count; }
+	const char *operator[](size_t i) const { return line[(head + i) % MSGLOG_LINES]; } // 0 = newest
+	char *push_front() {
+		head = (head + MSGLOG_LINES - 1) % MSGLOG_LINES;
+		if (count < MSGLOG_LINES) count++;
+		return line[head];
+	}
+};
+thread_local MsgLog msglog;
 void push_msg(const char *fmt, ...) {
-	char buf[128];
 	va_list ap;
 	va_start(ap, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, ap);
+	vsnprintf(msglog.push_front(), sizeof(msglog.line[0]), fmt, ap);
 	va_end(ap);
-	msglog.push_front(std::string(buf));
-	if (msglog.size() > 14) msglog.pop_back();
+	msg_count++;
+}
+
+/// Hardware counters
+// --perf: cycles, instructions, L1d and last-level cache misses and branch
+// misses per game phase, via one perf_event_open group on the main thread.
+// Events the kernel or VM refuses show as n/a; with none at all the phases
+// simply go uncounted and the report says why.
+enum PerfEvent { PE_CYCLES, PE_INSTR, PE_L1D_MISS, PE_LLC_MISS, PE_BRANCH_MISS, PE_COUNT };
+enum Phase { PH_GEN, PH_DEAD_ENDS, PH_ENEMIES, PH_DRAW, PH_COUNT };
+const char *phase_names[PH_COUNT] = { "gen", "remove_dead_ends", "enemies_turn", "draw" };
+
+struct PhaseCounts {
+	long long calls = 0;
+	uint64_t v[PE_COUNT] = {0};
+};
+PhaseCounts perf_phase[PH_COUNT];
+thread_local bool perf_on = false; // only the thread that opened the group counts
+int perf_leader = -1;
+int perf_slot[PE_COUNT];           // position of each event in a group read, -1 = unavailable
+int perf_open_count = 0;
+std::string perf_error;
+
+#ifdef __linux__
+int perf_open_event(uint32_t type, uint64_t config, int group) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = group < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+// Open the counter group for the calling thread; false if nothing could be counted
+bool perf_init() {
+	for (int e = 0; e < PE_COUNT; e++) perf_slot[e] = -1;
+#ifdef __linux__
+	struct { uint32_t type; uint64_t config; } ev[PE_COUNT] = {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	};
+	for (int e = 0; e < PE_COUNT; e++) {
+		int fd = perf_open_event(ev[e].type, ev[e].config, perf_leader);
+		if (fd < 0) {
+			if (perf_leader < 0 && perf_error.empty()) perf_error = strerror(errno);
+			continue;
+		}
+		if (perf_leader < 0) perf_leader = fd;
+		perf_slot[e] = perf_open_count++;
+	}
+	if (perf_leader < 0) return false;
+	ioctl(perf_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(perf_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	perf_on = true;
+	return true;
+#else
+	perf_error = "perf_event_open is Linux only";
+	return false;
+#endif
+}
+
+// Current group totals, indexed by PerfEvent
+void perf_read(uint64_t *out) {
+	uint64_t buf[1 + PE_COUNT];
+	if (read(perf_leader, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) { memset(out, 0, PE_COUNT * sizeof(uint64_t)); return; }
+	for (int e = 0; e < PE_COUNT; e++) out[e] = perf_slot[e] >= 0 ? buf[1 + perf_slot[e]] : 0;
+}
+
+// Counts everything between construction and destruction into one phase
+struct PerfScope {
+	Phase ph;
+	uint64_t start[PE_COUNT];
+	PerfScope(Phase p) : ph(p) { if (perf_on) perf_read(start); }
+	~PerfScope() {
+		if (!perf_on) return;
+		uint64_t end[PE_COUNT];
+		perf_read(end);
+		PhaseCounts &c = perf_phase[ph];
+		c.calls++;
+		for (int e = 0; e < PE_COUNT; e++) c.v[e] += end[e] - start[e];
+	}
+};
+
+// Per-call averages for every phase that ran
+void perf_report() {
+	if (!opt_perf) return;
+	if (!perf_on) { printf("perf: counters unavailable (%s)\n", perf_error.size() ? perf_error.c_str() : "no events"); return; }
+	printf("perf (per call)    %8s %11s %11s %5s %9s %9s %9s\n", "calls", "cycles", "instr", "IPC", "L1d-miss", "LLC-miss", "br-miss");
+	for (int p = 0; p < PH_COUNT; p++) {
+		const PhaseCounts &c = perf_phase[p];
+		if (!c.calls) continue;
+		printf("  %-16s %8lld", phase_names[p], c.calls);
+		for (int e = 0; e < PE_COUNT; e++) {
+			int width = e <= PE_INSTR ? 11 : 9;
+			if (perf_slot[e] < 0) printf(" %*s", width, "n/a");
+			else printf(" %*.0f", width, (double)c.v[e] / c.calls);
+			if (e == PE_INSTR) {
+				if (perf_slot[PE_CYCLES] >= 0 && perf_slot[PE_INSTR] >= 0 && c.v[PE_CYCLES])
+					printf(" %5.2f", (double)c.v[PE_INSTR] / c.v[PE_CYCLES]);
+				else printf(" %5s", "n/a");
+			}
+		}
+		printf("\n");
+	}
+}
+
+/// Events
+// Gameplay happenings are published as small typed records. Subscribers are
+// plain function pointers called in order: the message log turns events into
+// the familiar English lines, telemetry copies them into a lock-free queue
+// that a writer thread drains to a file.
+enum EventType : uint8_t {
+	EV_START, EV_MOVE, EV_ATTACK, EV_KILL, EV_LOOT, EV_MAX_HP, EV_NOTICE, EV_HIT, EV_ENEMY_DEFEND,
+	EV_DEFEND, EV_PICKUP, EV_POTION, EV_LEVEL, EV_ACHIEVEMENT, EV_END, EV_UNDO, EV_PLACE_TORCH, EV_TYPES
+};
+const char *event_names[EV_TYPES] = {
+	"start", "move", "attack", "kill", "loot", "max_hp", "notice", "hit", "enemy_defend",
+	"defend", "pickup", "potion", "level", "achievement", "end", "undo", "place_torch"
+};
+
+// Loot kinds carried in EV_LOOT's kind field
+enum LootKind : uint8_t { LOOT_COINS, LOOT_POTIONS, LOOT_TORCH, LOOT_HP };
+
+// 16 bytes; also the on-disk record of the binary telemetry format.
+// a/b per type: attack dmg/reduction, hit dmg/reduction, loot/pickup amount,
+// potion heal, max_hp new max, level number, achievement stat/tier, end code.
+struct GameEvent {
+	uint32_t turn;   // player turns taken so far
+	uint16_t level;
+	uint8_t type;
+	uint8_t kind;    // enemy archetype, item, loot kind... depending on type
+	uint8_t x, y;    // player position
+	int16_t hp;      // player hp after the event
+	int16_t a, b;
+};
+static_assert(sizeof(GameEvent) == 16, "GameEvent is a fixed 16-byte record");
+
+typedef void (*EventHandler)(const GameEvent &ev);
+#define MAX_SUBSCRIBERS 4
+thread_local EventHandler subscribers[MAX_SUBSCRIBERS]; // per thread: simulations have none
+thread_local int subscriber_count = 0;
+thread_local uint32_t turn_count = 0;
+
+void subscribe(EventHandler h) {
+	if (subscriber_count < MAX_SUBSCRIBERS) subscribers[subscriber_count++] = h;
+}
+
+// Publish an event stamped with the current turn, level and player state
+void emit(uint8_t type, int kind = 0, int a = 0, int b = 0) {
+	GameEvent ev;
+	ev.turn = turn_count; ev.level = (uint16_t)level;
+	ev.type = type; ev.kind = (uint8_t)kind;
+	ev.x = (uint8_t)x; ev.y = (uint8_t)y; ev.hp = (int16_t)hp;
+	ev.a = (int16_t)a; ev.b = (int16_t)b;
+	for (int i = 0; i < subscriber_count; i++) subscribers[i](ev);
+}
+
+// Single-producer single-consumer ring. The game thread only writes tail,
+// the writer only writes head, so each side needs one acquire load of the
+// other's index and one release store of its own.
+template<typename T, size_t N>
+struct SpscQueue {
+	static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+	alignas(64) std::atomic<size_t> head{0};
+	alignas(64) std::atomic<size_t> tail{0};
+	alignas(64) T slots[N];
+
+	bool push(const T &v) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == N) return false;
+		slots[t & (N - 1)] = v;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+	// Copy out up to max items; returns how many
+	size_t pop(T *out, size_t max) {
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t n = tail.load(std::memory_order_acquire) - h;
+		if (n > max) n = max;
+		for (size_t i = 0; i < n; i++) out[i] = slots[(h + i) & (N - 1)];
+		head.store(h + n, std::memory_order_release);
+		return n;
+	}
+};
+
+// Telemetry: events queued by the game and written out by a background thread.
+// If the writer falls behind the queue fills and events are dropped (and
+// counted) rather than stalling the game.
+SpscQueue<GameEvent, 4096> telemetry_queue;
+std::thread telemetry_thread;
+std::atomic<bool> telemetry_stop{false};
+FILE *telemetry_file = NULL;
+unsigned long long telemetry_sent = 0, telemetry_dropped = 0;
+
+void telemetry_subscriber(const GameEvent &ev) {
+	if (telemetry_queue.push(ev)) telemetry_sent++;
+	else telemetry_dropped++;
+}
+
+void telemetry_write(const GameEvent *ev, size_t n) {
+	if (!opt_telemetry_json) { fwrite(ev, sizeof(GameEvent), n, telemetry_file); return; }
+	for (size_t i = 0; i < n; i++) {
+		const GameEvent &e = ev[i];
+		fprintf(telemetry_file, "{\"turn\":%u,\"level\":%u,\"ev\":\"%s\",\"kind\":%u,\"x\":%u,\"y\":%u,\"hp\":%d,\"a\":%d,\"b\":%d}\n",
+			(unsigned)e.turn, (unsigned)e.level, e.type < EV_TYPES ? event_names[e.type] : "?",
+			(unsigned)e.kind, (unsigned)e.x, (unsigned)e.y, (int)e.hp, (int)e.a, (int)e.b);
+	}
+}
+
+void telemetry_writer() {
+	GameEvent batch[256];
+	for (;;) {
+		bool stopping = telemetry_stop.load(std::memory_order_acquire);
+		size_t n = telemetry_queue.pop(batch, 256);
+		if (n) { telemetry_write(batch, n); continue; }
+		if (stopping) break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+	fflush(telemetry_file);
+}
+
+// Binary streams start with "RLEV", a version and the record size
+bool telemetry_start() {
+	telemetry_file = fopen(opt_telemetry_path.c_str(), "wb");
+	if (!telemetry_file) { perror(opt_telemetry_path.c_str()); return false; }
+	if (!opt_telemetry_json) {
+		const char magic[4] = { 'R', 'L', 'E', 'V' };
+		uint16_t hdr[2] = { 1, (uint16_t)sizeof(GameEvent) };
+		fwrite(magic, 1, 4, telemetry_file);
+		fwrite(hdr, sizeof(hdr), 1, telemetry_file);
+	}
+	subscribe(telemetry_subscriber);
+	telemetry_thread = std::thread(telemetry_writer);
+	return true;
+}
+
+void telemetry_finish() {
+	if (!telemetry_file) return;
+	telemetry_stop.store(true, std::memory_order_release);
+	telemetry_thread.join();
+	fclose(telemetry_file);
+	telemetry_file = NULL;
+}
+
+/// Achievements
+// One ladder per stat, sorted by threshold; only the highest tier reached
+// counts. Tiers unlock during play as soon as a threshold is crossed and stay
+// unlocked. The same tables score finished and simulated runs.
+struct Achievement {
+	int threshold;
+	int points;
+	const char *title;
+};
+
+constexpr Achievement kill_tiers[] = {
+	{1, 1, "First Blood"}, {10, 2, "Skirmisher (10 kills)"}, {25, 3, "Reckless (25 kills)"},
+	{50, 4, "Merciless (50 kills)"}, {100, 5, "Butcher (100 kills)"}, {250, 6, "Executioner (250 kills)"},
+	{500, 7, "One-Man Army (500 kills)"}, {1000, 8, "Slayer (1000 kills)"},
+};
+constexpr Achievement coin_tiers[] = {
+	{50, 1, "Pocket Change (50 coins)"}, {100, 2, "Well-to-do (100 coins)"}, {250, 3, "Entrepreneur (250 coins)"},
+	{500, 4, "Deep Pockets (500 coins)"}, {750, 5, "Tycoon (750 coins)"}, {1000, 6, "Filthy Rich (1000 coins)"},
+};
+constexpr Achievement potion_tiers[] = {
+	{5, 1, "Taste Tester (5 potions)"}, {25, 2, "Stockpiler (25 potions)"}, {50, 3, "Lifeline (50 potions)"},
+	{100, 4, "Apothecary's Friend (100 potions)"}, {200, 5, "The Human Flask (200 potions)"},
+};
+constexpr Achievement level_tiers[] = {
+	{2, 1, "First Step (more than 1 level)"}, {5, 2, "Taste Tester (5 levels)"}, {10, 3, "Spelunker (10 levels)"},
+	{25, 4, "Deep Diver (25 levels)"}, {50, 5, "Abyssal Voyager (50 levels)"}, {75, 6, "Labyrinth Master (50 levels)"},
+	{100, 7, "The Human Flask (100 levels)"},
+};
+
+enum Stat { STAT_KILLS, STAT_COINS, STAT_POTIONS, STAT_LEVEL, STAT_COUNT };
+
+struct Ladder {
+	const Achievement *tiers;
+	int count;
+};
+
+#define LADDER(t) { t, (int)(sizeof(t) / sizeof(t[0])) }
+constexpr Ladder ladders[STAT_COUNT] = { LADDER(kill_tiers), LADDER(coin_tiers), LADDER(potion_tiers), LADDER(level_tiers) };
+
+// What the score and achievements are computed from
+struct RunStats {
+	int kills, coins, potions, level;
+	int sword, hp, potions_used, moves;
+	int stat(int st) const {
+		switch (st) {
+			case STAT_KILLS: return kills;
+			case STAT_COINS: return coins;
+			case STAT_POTIONS: return potions;
+			default: return level;
+		}
+	}
+};
+
+RunStats current_stats() {
+	RunStats s = { kills, coins, potions, deepest_level, swordDamage, hp, potions_used, moves };
+	return s;
+}
+
+// Highest tier with threshold <= v, -1 if none
+int ladder_tier(const Ladder &l, int v) {
+	const Achievement *end = std::upper_bound(l.tiers, l.tiers + l.count, v,
+		[](int val, const Achievement &a) { return val < a.threshold; });
+	return (int)(end - l.tiers) - 1;
+}
+
+// Achievement points for final stats (used when no live tracking happened)
+int achievement_points(const RunStats &s) {
+	int pts = 0;
+	for (int st = 0; st < STAT_COUNT; st++) {
+		int tier = ladder_tier(ladders[st], s.stat(st));
+		if (tier >= 0) pts += ladders[st].tiers[tier].points;
+	}
+	return pts;
+}
+
+long compute_score(const RunStats &s, int ach) {
+	long score = 0;
+	score += (long)s.kills * 100;
+	score += (long)s.coins * 2;
+	score += (long)s.level * 500;
+	score += (long)s.sword * 50;
+	score += (long)s.hp * 10;
+	score += (long)s.potions_used * 20;
+	score += (long)ach * 500;
+	score -= (long)s.moves; // penalty for too many moves
+	return score;
+}
+
+// Live tracking: highest tier unlocked so far per stat
+thread_local int unlocked_tier[STAT_COUNT] = {-1, -1, -1, -1};
+
+// Unlock whatever the current stats have reached; O(1) per stat unless a
+// threshold was crossed
+void check_achievements() {
+	RunStats s = current_stats();
+	for (int st = 0; st < STAT_COUNT; st++) {
+		const Ladder &l = ladders[st];
+		int next = unlocked_tier[st] + 1;
+		if (next >= l.count || s.stat(st) < l.tiers[next].threshold) continue;
+		unlocked_tier[st] = ladder_tier(l, s.stat(st));
+		emit(EV_ACHIEVEMENT, 0, st, unlocked_tier[st]);
+	}
+}
+
+// Points from the tiers unlocked so far
+int unlocked_points() {
+	int pts = 0;
+	for (int st = 0; st < STAT_COUNT; st++)
+		if (unlocked_tier[st] >= 0) pts += ladders[st].tiers[unlocked_tier[st]].points;
+	return pts;
+}
+
+// The message log is just another subscriber
+void message_subscriber(const GameEvent &ev) {
+	switch (ev.type) {
+		case EV_START: push_msg("Game started."); break;
+		case EV_ATTACK: push_msg("You hit the enemy for %d damage.", ev.a); break;
+		case EV_KILL: push_msg("Victory! You have defeated the enemy."); break;
+		case EV_LOOT:
+			switch (ev.kind) {
+				case LOOT_COINS: push_msg("You gain %d coins.", ev.a); break;
+				case LOOT_POTIONS: push_msg("You gain %d potion(s).", ev.a); break;
+				case LOOT_TORCH: push_msg("You gain %d torch(es).", ev.a); break;
+				case LOOT_HP: push_msg("You recovered %d HP.", ev.a); break;
+			}
+			break;
+		case EV_MAX_HP: push_msg("Max HP increased to %d!", ev.a); break;
+		case EV_NOTICE: push_msg("An enemy notices you!"); break;
+		case EV_HIT:
+			if (ev.b > 0) push_msg("Your defense reduced damage by %d.", ev.b);
+			push_msg("Enemy hits you for %d damage.", ev.a);
+			break;
+		case EV_ENEMY_DEFEND: push_msg("Enemy defends."); break;
+		case EV_PICKUP: push_msg(item_defs[ev.kind].msg, ev.a); break;
+		case EV_POTION: push_msg("You used a potion and recovered %d HP.", ev.a); break;
+		case EV_LEVEL: push_msg("Entering level %d.", ev.a); break;
+		case EV_ACHIEVEMENT: push_msg("Achievement: %s", ladders[ev.a].tiers[ev.b].title); break;
+		case EV_UNDO: push_msg("You step back to turn %d.", ev.a); break;
+		case EV_PLACE_TORCH: push_msg("You set down a torch (-%d).", ev.a); break;
+	}
+}
+
+// Helper: check whether a tile is walkable (not a wall). Any map cell or
+// neighbour of one is valid: the sentinel ring answers "wall".
+template <class D> bool walkable(int px, int py) {
+	return !(lvl[D::at(px, py)] & WALL);
+}
+
+bool is_walkable(int px, int py) { return walkable<DynamicDims>(px, py); }
+
+/// Distance to stairs
+// Steps from every floor tile to the stairs, in the same sentinel-bordered
+// layout as lvl. Built by one BFS in gen() once the stairs are placed; every
+// wall opened after that goes through carve(), which only relaxes the
+// distances the new tile shortens. Walls and unreachable tiles hold DIST_INF.
+#define DIST_INF INT16_MAX
+thread_local int16_t *stairs_dist; // tile (0, 0), lives in level_arena
+thread_local int *dist_queue;      // BFS scratch, one slot per grid cell
+
+const char step_keys[4] = { 'd', 'a', 's', 'w' }; // x+1, x-1, y+1, y-1
+
+// Relax outwards from the first n cells of dist_queue
+template <class D> void spread_dist(int n) {
+	const int off[4] = { D::stride(), -D::stride(), 1, -1 };
+	for (int q = 0; q < n; q++) {
+		int c = dist_queue[q];
+		int16_t nd = stairs_dist[c] + 1;
+		for (int k = 0; k < 4; k++) {
+			int nb = c + off[k];
+			if ((lvl[nb] & WALL) || stairs_dist[nb] <= nd) continue;
+			stairs_dist[nb] = nd;
+			dist_queue[n++] = nb;
+		}
+	}
+}
+
+template <class D> void build_stairs_dist(int sx, int sy) {
+	size_t cells = (size_t)(D::w() + 2) * D::stride() + 1;
+	int16_t *field = level_alloc<int16_t>(cells);
+	for (size_t i = 0; i < cells; i++) field[i] = DIST_INF;
+	stairs_dist = field + D::stride() + 1;
+	dist_queue = level_alloc<int>(cells);
+	stairs_dist[D::at(sx, sy)] = 0;
+	dist_queue[0] = D::at(sx, sy);
+	spread_dist<D>(1);
+}
+
+// Turn a wall into floor and keep the field exact. Opening a tile can only
+// shorten paths, so this is a BFS from the new tile over what it improves.
+template <class D> void carve(int c) {
+	if (!(lvl[c] & WALL)) return;
+	lvl[c] = 0;
+	const int off[4] = { D::stride(), -D::stride(), 1, -1 };
+	int16_t best = DIST_INF;
+	for (int k = 0; k < 4; k++)
+		if (stairs_dist[c + off[k]] < best) best = stairs_dist[c + off[k]];
+	if (best == DIST_INF) return; // not connected yet; picked up when it is
+	stairs_dist[c] = best + 1;
+	dist_queue[0] = c;
+	spread_dist<D>(1);
+}
+
+// Key for the next step towards the stairs, 0 if on them or cut off
+int stairs_step_key() {
+	const int off[4] = { map_stride, -map_stride, 1, -1 };
+	int c = x * map_stride + y, best = -1;
+	int16_t bd = stairs_dist[c];
+	for (int k = 0; k < 4; k++)
+		if (stairs_dist[c + off[k]] < bd) { bd = stairs_dist[c + off[k]]; best = k; }
+	return best < 0 ? 0 : step_keys[best];
+}
+
+/// Exploration
+// seen marks every tile that has been lit on this level. The target set holds
+// the seen floor tiles worth walking to: those next to an unseen tile (the
+// frontier) and those holding an item. It is a sparse set (O(1) insert, erase
+// and lookup) and only tiles whose state just changed are re-examined: newly
+// lit tiles with their neighbours, and tiles whose item was taken.
+// Auto-explore plans a path to the nearest target with one BFS and follows
+// it until that target leaves the set, instead of searching on every step.
+thread_local uint8_t *seen;          // tile (0, 0); the sentinel ring counts as seen
+thread_local int *target_pos;        // index in target_dense, -1 = not a target
+thread_local int *target_dense;
+thread_local int target_count;
+thread_local int *explore_prev;      // BFS parents
+thread_local int *explore_path;      // planned cells, next step last
+thread_local int explore_len, explore_goal;
+
+bool is_target(int c) {
+	if (!seen[c] || (lvl[c] & WALL)) return false;
+	if (tile_table.look[lvl[c]].action == ACT_ITEM) return true;
+	return !seen[c + map_stride] || !seen[c - map_stride] || !seen[c + 1] || !seen[c - 1];
+}
+
+void update_target(int c) {
+	bool want = is_target(c);
+	if (want == (target_pos[c] >= 0)) return;
+	if (want) {
+		target_pos[c] = target_count;
+		target_dense[target_count++] = c;
+	} else {
+		int last = target_dense[--target_count];
+		target_dense[target_pos[c]] = last;
+		target_pos[last] = target_pos[c];
+		target_pos[c] = -1;
+	}
+}
+
+/// Light
+// A light source of radius r casts r + 1 - distance over its diamond, so light
+// fades towards the edge and overlapping sources add up. light holds, per
+// tile, the sum cast by the torches lying on the floor; setting one down or
+// taking it only walks its own diamond, and nothing rescans the map after
+// level setup. The carried torch moves every turn, so it is not in light:
+// draw() adds its closed form, and reveal() only walks the edge of its
+// diamond to mark new tiles seen. A tile is seen once any source has lit it;
+// draw() shows what is lit right now.
+#define FLOOR_TORCH_RADIUS 3
+#define LIGHT_FULL 4        // light from which a tile shows its full colour
+#define TORCH_PLACE_COST 20 // what picking the torch back up gives
+
+thread_local uint16_t *light;
+thread_local int light_fresh; // tiles first lit, queued in dist_queue
+thread_local int lit_x, lit_y, lit_radius = -1; // last reveal(); radius -1 forces a full scan
+
+int torch_radius() { return min(10, torch/2); }
+
+// What the carried torch casts on tile (px, py)
+inline int carried_light(int px, int py) {
+	int r = torch_radius(), d = abs(px - x) + abs(py - y);
+	return d <= r ? r + 1 - d : 0;
+}
+
+void light_tile(int px, int py) {
+	if (px < 0 || py < 0 || px >= map_w || py >= map_h) return;
+	int c = px * map_stride + py;
+	if (seen[c]) return;
+	seen[c] = 2;
+	dist_queue[light_fresh++] = c;
+}
+
+// Add (sign 1) or remove (sign -1) one source's light
+void light_source(int sx, int sy, int r, int sign) {
+	if (r < 0) return;
+	int x0 = std::max(sx - r, 0), x1 = min(sx + r, map_w - 1);
+	for (int px = x0; px <= x1; px++) {
+		int reach = r - abs(px - sx);
+		int y0 = std::max(sy - reach, 0), y1 = min(sy + reach, map_h - 1);
+		for (int py = y0; py <= y1; py++) {
+			int c = px * map_stride + py;
+			light[c] += sign * (reach + 1 - abs(py - sy));
+			if (sign > 0) light_tile(px, py);
+		}
+	}
+}
+
+// Re-examine the tiles first lit since the last call. They are tagged 2 until
+// then, so each one and each already seen neighbour is looked at once,
+// however many new tiles it touches.
+void light_settle() {
+	const int off[4] = { map_stride, -map_stride, 1, -1 };
+	int fresh = light_fresh;
+	for (int i = 0; i < fresh; i++) {
+		int c = dist_queue[i];
+		update_target(c);
+		for (int k = 0; k < 4; k++)
+			if (seen[c + off[k]] == 1) update_target(c + off[k]);
+	}
+	for (int i = 0; i < fresh; i++) seen[dist_queue[i]] = 1;
+	light_fresh = 0;
+}
+
+// Mark what the carried torch lights around the player. After a single step
+// with a radius no larger than last time only the diamond's leading edge can
+// be new; otherwise the whole diamond is scanned.
+void reveal() {
+	int radius = torch_radius();
+	int mx = x - lit_x, my = y - lit_y;
+	if (lit_radius >= 0 && radius <= lit_radius && abs(mx) + abs(my) <= 1) {
+		if (mx || my) {
+			for (int t = -radius; t <= radius; t++) {
+				int a = radius - abs(t);
+				light_tile(x + mx * a + my * t, y + my * a + mx * t);
+			}
+		}
+	} else {
+		for (int dx = -radius; dx <= radius; dx++) {
+			int reach = radius - abs(dx);
+			for (int dy = -reach; dy <= reach; dy++) light_tile(x + dx, y + dy);
+		}
+	}
+	lit_x = x; lit_y = y; lit_radius = radius;
+	light_settle();
+}
+
+// A torch was set down on or taken from tile c
+void floor_torch_changed(int c, bool lit) {
+	light_source(c / map_stride, c % map_stride, FLOOR_TORCH_RADIUS, lit ? 1 : -1);
+	light_settle();
+}
+
+// Per-level state, once the grid and the player are in place
+template <class D> void init_exploration() {
+	size_t cells = (size_t)(D::w() + 2) * D::stride() + 1;
+	int base = D::stride() + 1;
+	seen = level_alloc<uint8_t>(cells) + base;
+	target_pos = level_alloc<int>(cells) + base;
+	target_dense = level_alloc<int>(cells);
+	explore_prev = level_alloc<int>(cells) + base;
+	explore_path = level_alloc<int>(cells);
+	light = level_alloc<uint16_t>(cells) + base;
+	memset(light - base, 0, cells * sizeof(uint16_t));
+	memset(seen - base, 1, cells);
+	for (int i = 0; i < D::w(); i++)
+		for (int j = 0; j < D::h(); j++) seen[D::at(i, j)] = 0;
+	for (size_t i = 0; i < cells; i++) target_pos[(int)i - base] = -1;
+	target_count = 0;
+	explore_len = 0; explore_goal = -1;
+	light_fresh = 0;
+	for (int i = 0; i < D::w(); i++)
+		for (int j = 0; j < D::h(); j++)
+			if (lvl[D::at(i, j)] & TORCH) light_source(i, j, FLOOR_TORCH_RADIUS, 1);
+	lit_radius = -1;
+	reveal();
 }
 
-// Helper: check whether a tile is walkable (not a wall)
-bool is_walkable(int px, int py) {
-	if (px < 0 || py < 0 || px >= MAPSIZE || py >= MAPSIZE) return false;
-	return !(lvl[px][py] & WALL);
+// BFS from the player to the nearest target other than the player's tile
+bool explore_plan() {
+	const int off[4] = { map_stride, -map_stride, 1, -1 };
+	int base = map_stride + 1;
+	size_t cells = (size_t)(map_w + 2) * map_stride + 1;
+	memset(explore_prev - base, 0xff, cells * sizeof(int)); // -1 = unvisited
+	int start = x * map_stride + y, n = 1;
+	explore_prev[start] = start;
+	dist_queue[0] = start;
+	explore_len = 0; explore_goal = -1;
+	for (int q = 0; q < n; q++) {
+		int c = dist_queue[q];
+		if (c != start && target_pos[c] >= 0) {
+			explore_goal = c;
+			for (; c != start; c = explore_prev[c]) explore_path[explore_len++] = c;
+			return true;
+		}
+		for (int k = 0; k < 4; k++) {
+			int nb = c + off[k];
+			if (explore_prev[nb] != -1 || (lvl[nb] & WALL)) continue;
+			explore_prev[nb] = c;
+			dist_queue[n++] = nb;
+		}
+	}
+	return false;
+}
+
+// Key for the next auto-explore step, 0 when nothing reachable is left
+int explore_step_key() {
+	int c = x * map_stride + y;
+	if (explore_len > 0 && explore_path[explore_len - 1] == c) explore_len--; // arrived
+	bool stale = explore_goal < 0 || target_pos[explore_goal] < 0 || explore_len == 0;
+	if (!stale) {
+		int d = explore_path[explore_len - 1] - c;
+		stale = d != map_stride && d != -map_stride && d != 1 && d != -1; // knocked off the path
+	}
+	if (stale && !explore_plan()) return 0;
+	int d = explore_path[explore_len - 1] - c;
+	return d == map_stride ? 'd' : d == -map_stride ? 'a' : d == 1 ? 's' : 'w';
 }
 
 // Remove simple dead-ends by opening adjacent walls
-void remove_dead_ends() {
+template <class D> void remove_dead_ends() {
+	const int dirs[4][2] = {{1,0},{-1,0},{0,1},{0,-1}};
+	const int off[4] = { D::stride(), -D::stride(), 1, -1 }; // the same four as cell offsets
 	bool changed = true;
 	int iter = 0;
 	while (changed && iter < 1000) {
 		changed = false;
 		iter++;
-		for (int j = 1; j < MAPSIZE-1; j++) {
-			for (int i = 1; i < MAPSIZE-1; i++) {
-				if (!is_walkable(i, j)) continue;
-				int walls = 0;
-				if (!is_walkable(i+1, j)) walls++;
-				if (!is_walkable(i-1, j)) walls++;
-				if (!is_walkable(i, j+1)) walls++;
-				if (!is_walkable(i, j-1)) walls++;
+		for (int j = 1; j < D::h()-1; j++) {
+			for (int i = 1; i < D::w()-1; i++) {
+				tile_t *c = &lvl[D::at(i, j)];
+				if (*c & WALL) continue;
+				int walls = (c[off[0]] & WALL) + (c[off[1]] & WALL) + (c[off[2]] & WALL) + (c[off[3]] & WALL); // WALL is bit 0
 				if (walls >= 3) {
-					// open one adjacent wall (try random order)
-					int dirs[4][2] = {{1,0},{-1,0},{0,1},{0,-1}};
+					// open one adjacent wall (try random order), never the outer ring
 					for (int d = 0; d < 4; d++) {
-						int r = rand() % 4;
-						int tx = i + dirs[r][0];
-						int ty = j + dirs[r][1];
-						if (tx > 0 && tx < MAPSIZE-1 && ty > 0 && ty < MAPSIZE-1 && !is_walkable(tx, ty)) {
-							lvl[tx][ty] = 0; // carve to floor
+						int r = rnd(gen_rng, 4);
+						if ((c[off[r]] & WALL) && D::interior(i + dirs[r][0], j + dirs[r][1])) {
+							carve<D>(D::at(i, j) + off[r]); // carve to floor
 							changed = true;
 							break;
 						}
@@ -124,6 +1169,159 @@ void remove_dead_ends() {
 	}
 }
 
+/// Undo journal
+// 'u' steps back one turn. A turn is stored as the changes it made: the old
+// value of every player field and enemy word that differs from a snapshot
+// taken when the turn began, plus each tile written during the turn
+// (journal_tile() goes before the write). Entries fill a ring, with a marker
+// closing each turn; undo restores back to the previous marker in reverse
+// order, O(changes). The ring keeps --undo-depth turns, dropping the oldest
+// first. Taking the stairs starts a new journal, sized for that many turns of
+// the worst case on the level: every player field, every word of every enemy,
+// the one tile a player action writes and the marker.
+#define JOURNAL_TILES_PER_TURN 1 // a pickup or a torch set down
+
+struct JournalEntry {
+	void *addr;   // NULL marks the end of a turn
+	uint64_t old; // first size bytes are the value before the turn
+	uint32_t size;
+	int32_t cell; // tile index for tile entries, -1 otherwise
+};
+
+struct JournalField {
+	void *addr;
+	uint32_t size;
+};
+
+// Per thread like the rest of the game state: simulation and batch workers
+// start runs too, but only the turn-based game's thread switches it on
+thread_local bool journal_on = false;
+thread_local std::vector<JournalEntry> journal;    // ring
+thread_local size_t journal_head = 0, journal_len = 0; // next slot, entries held
+thread_local int journal_turns = 0;                // complete turns held
+thread_local int journal_level = 0;                // level the open turn started on
+thread_local bool journal_overflow = false;        // the open turn outgrew the ring
+#define PLAYER_FIELDS (15 + STAT_COUNT)
+thread_local JournalField journal_fields[PLAYER_FIELDS];
+thread_local uint64_t journal_before[PLAYER_FIELDS];
+thread_local std::vector<Enemy> journal_enemies;
+
+void journal_clear() {
+	if (!journal_on) return;
+	journal_head = journal_len = 0;
+	journal_turns = 0;
+}
+
+void journal_init() {
+	JournalField f[PLAYER_FIELDS - STAT_COUNT] = {
+		{ &x, sizeof(x) }, { &y, sizeof(y) }, { &coins, sizeof(coins) }, { &moves, sizeof(moves) },
+		{ &torch, sizeof(torch) }, { &potions, sizeof(potions) }, { &potions_used, sizeof(potions_used) },
+		{ &swordDamage, sizeof(swordDamage) }, { &max_hp, sizeof(max_hp) }, { &hp, sizeof(hp) },
+		{ &kills, sizeof(kills) }, { &player_defending, sizeof(player_defending) },
+		{ &enemies_noticed, sizeof(enemies_noticed) }, { &turn_count, sizeof(turn_count) },
+		{ &combat_rng.pos, sizeof(combat_rng.pos) },
+	};
+	for (int i = 0; i < PLAYER_FIELDS - STAT_COUNT; i++) journal_fields[i] = f[i];
+	for (int st = 0; st < STAT_COUNT; st++) journal_fields[PLAYER_FIELDS - STAT_COUNT + st] = { &unlocked_tier[st], sizeof(int) };
+	journal_on = true;
+	journal_clear();
+}
+
+size_t journal_prev(size_t i) { return (i ? i : journal.size()) - 1; }
+
+// Forget the oldest turn
+void journal_drop_oldest() {
+	size_t tail = (journal_head + journal.size() - journal_len) % journal.size();
+	while (journal_len) {
+		bool marker = journal[tail].addr == NULL;
+		tail = (tail + 1) % journal.size();
+		journal_len--;
+		if (marker) break;
+	}
+	journal_turns--;
+}
+
+void journal_push(void *addr, uint64_t old, uint32_t size, int cell) {
+	if (journal_len == journal.size()) {
+		if (journal_turns == 0) { journal_overflow = true; return; }
+		journal_drop_oldest();
+	}
+	JournalEntry &e = journal[journal_head];
+	e.addr = addr; e.old = old; e.size = size; e.cell = cell;
+	journal_head = (journal_head + 1) % journal.size();
+	journal_len++;
+}
+
+// Ring slots one turn on this level can take at most
+size_t journal_turn_bound() {
+	return PLAYER_FIELDS + enemies.size() * (sizeof(Enemy) / 4) + JOURNAL_TILES_PER_TURN + 1;
+}
+
+// A turn may be starting: remember what it can change
+void journal_begin() {
+	if (!journal_on) return;
+	size_t want = (size_t)opt_undo_depth * journal_turn_bound();
+	if (journal_len == 0 && journal.size() != want) {
+		// a fresh journal, on a level with more or fewer enemies than the last
+		journal.resize(want);
+		journal_head = 0;
+	}
+	journal_level = level;
+	for (int i = 0; i < PLAYER_FIELDS; i++) memcpy(&journal_before[i], journal_fields[i].addr, journal_fields[i].size);
+	journal_enemies.assign(enemies.begin(), enemies.end());
+}
+
+// Call before writing tile c during a turn
+void journal_tile(int c) {
+	if (journal_on) journal_push(&lvl[c], lvl[c], sizeof(tile_t), c);
+}
+
+// The turn is over: record what differs from journal_begin() and close it
+void journal_commit() {
+	if (!journal_on) return;
+	if (level != journal_level || journal_overflow) {
+		// a new level, or a turn too big to keep: nothing before it can be undone
+		journal_clear();
+		journal_overflow = false;
+		return;
+	}
+	for (int i = 0; i < PLAYER_FIELDS; i++)
+		if (memcmp(journal_fields[i].addr, &journal_before[i], journal_fields[i].size) != 0)
+			journal_push(journal_fields[i].addr, journal_before[i], journal_fields[i].size, -1);
+	for (size_t e = 0; e < enemies.size(); e++) {
+		uint32_t *now = (uint32_t *)&enemies[e];
+		const uint32_t *was = (const uint32_t *)&journal_enemies[e];
+		for (size_t w = 0; w < sizeof(Enemy) / 4; w++)
+			if (now[w] != was[w]) journal_push(&now[w], was[w], 4, -1);
+	}
+	if (journal_overflow) { journal_clear(); journal_overflow = false; return; }
+	journal_push(NULL, 0, 0, -1);
+	journal_turns++;
+	while (journal_turns > opt_undo_depth) journal_drop_oldest();
+}
+
+// Rewind the last turn; false if there is none
+bool undo_turn() {
+	if (!journal_on || journal_turns == 0) return false;
+	journal_head = journal_prev(journal_head); // the turn's marker
+	journal_len--;
+	while (journal_len && journal[journal_prev(journal_head)].addr) {
+		journal_head = journal_prev(journal_head);
+		journal_len--;
+		const JournalEntry &e = journal[journal_head];
+		tile_t was = e.cell >= 0 ? lvl[e.cell] : 0;
+		memcpy(e.addr, &e.old, e.size);
+		if (e.cell < 0) continue;
+		update_target(e.cell);
+		if ((was ^ lvl[e.cell]) & TORCH) floor_torch_changed(e.cell, lvl[e.cell] & TORCH);
+	}
+	journal_turns--;
+	explore_len = 0;
+	lit_radius = -1; // light up from scratch around the restored position
+	reveal();
+	return true;
+}
+
 // Return index of enemy at position or -1
 int enemy_at(int px, int py) {
 	for (size_t i = 0; i < enemies.size(); i++) {
@@ -148,57 +1346,58 @@ int adjacent_enemy_index() {
 void drop_loot(int enemy_index) {
 	if (enemy_index < 0 || enemy_index >= (int)enemies.size()) return;
 	Enemy &e = enemies[enemy_index];
-	if (e.coins_drop > 0) { coins += e.coins_drop; push_msg("You gain %d coins.", e.coins_drop); }
-	if (e.potions_drop > 0) { potions += e.potions_drop; push_msg("You gain %d potion(s).", e.potions_drop); }
-	if (e.torch_drop > 0) { torch += e.torch_drop; push_msg("You gain %d torch(es).", e.torch_drop); }
-	if (e.hp_drop > 0) { hp += e.hp_drop; if (hp > max_hp) hp = max_hp; push_msg("You recovered %d HP.", e.hp_drop); }
+	if (e.coins_drop > 0) { coins += e.coins_drop; emit(EV_LOOT, LOOT_COINS, e.coins_drop); }
+	if (e.potions_drop > 0) { potions += e.potions_drop; emit(EV_LOOT, LOOT_POTIONS, e.potions_drop); }
+	if (e.torch_drop > 0) { torch += e.torch_drop; emit(EV_LOOT, LOOT_TORCH, e.torch_drop); }
+	if (e.hp_drop > 0) { hp += e.hp_drop; if (hp > max_hp) hp = max_hp; emit(EV_LOOT, LOOT_HP, e.hp_drop); }
 	// track kills and increase max HP every 10 kills
 	kills++;
 	if (kills % 10 == 0) {
 		max_hp += 1;
-		push_msg("Max HP increased to %d!", max_hp);
+		emit(EV_MAX_HP, 0, max_hp);
 	}
 }
 
 // Process all enemies' turns (after player acts)
-void process_enemies_turn() {
+template <class D> void enemies_turn() {
 	int activation_distance = 4 + level/2; // when player gets closer, enemies become active
 	for (size_t i = 0; i < enemies.size(); i++) {
 		Enemy &e = enemies[i];
 		if (!e.alive) continue;
 		int dist = abs(e.x - x) + abs(e.y - y);
-		if (!e.active && dist <= activation_distance) { e.active = true; push_msg("An enemy notices you!"); }
+		if (!e.active && dist <= activation_distance) { e.active = true; enemies_noticed++; emit(EV_NOTICE, e.kind, dist); }
 			if (!e.active) continue;
 			// reset defending flag from previous turn
 			e.defending = false;
 			// If adjacent to player -> attack or defend
 			if (dist == 1) {
-				int act = rand() % 100;
+				int act = rnd(combat_rng, 100);
 				if (act < 70) {
 					// attack
-					int raw = e.damage + rand() % (e.damage + 1);
+					int raw = e.damage + rnd(combat_rng, e.damage + 1);
 					int reduction = 0;
-					if (player_defending) reduction = rand() % (swordDamage + 1);
+					if (player_defending) reduction = rnd(combat_rng, swordDamage + 1);
 					int dmg = raw - reduction;
 					if (dmg < 0) dmg = 0;
 					hp -= dmg;
-					if (reduction > 0) push_msg("Your defense reduced damage by %d.", reduction);
-					push_msg("Enemy hits you for %d damage.", dmg);
+					emit(EV_HIT, e.kind, dmg, reduction);
 				} else {
 					// defend this turn (reduces next player's damage)
 					e.defending = true;
-					push_msg("Enemy defends.");
+					emit(EV_ENEMY_DEFEND, e.kind);
 				}
 			} else {
 			// move towards player one tile (try x then y)
 			int dx = (x > e.x) ? 1 : (x < e.x ? -1 : 0);
 			int dy = (y > e.y) ? 1 : (y < e.y ? -1 : 0);
+			// the outer ring is wall, so a walkable target is always inside the map
+			const tile_t *here = &lvl[D::at(e.x, e.y)];
 			int nx = e.x + dx, ny = e.y;
-			if (dx != 0 && nx > 0 && nx < MAPSIZE-1 && ny > 0 && ny < MAPSIZE-1 && is_walkable(nx, ny) && enemy_at(nx, ny) == -1 && !(nx==x && ny==y)) {
+			if (dx != 0 && !(here[dx * D::stride()] & WALL) && enemy_at(nx, ny) == -1 && !(nx==x && ny==y)) {
 				e.x = nx; e.y = ny;
 			} else {
 				int nx2 = e.x, ny2 = e.y + dy;
-				if (dy != 0 && nx2 > 0 && nx2 < MAPSIZE-1 && ny2 > 0 && ny2 < MAPSIZE-1 && is_walkable(nx2, ny2) && enemy_at(nx2, ny2) == -1 && !(nx2==x && ny2==y)) {
+				if (dy != 0 && !(here[dy] & WALL) && enemy_at(nx2, ny2) == -1 && !(nx2==x && ny2==y)) {
 					e.x = nx2; e.y = ny2;
 				}
 			}
@@ -208,199 +1407,952 @@ void process_enemies_turn() {
 	player_defending = false;
 }
 
-/// Generates the dungeon map
-void gen(int seed) {
-	// Seed RNG using high-resolution time combined with provided seed
-	unsigned int s = (unsigned int)(std::chrono::high_resolution_clock::now().time_since_epoch().count() ^ (unsigned long long)seed);
-	srand(s);
-	// Message: entering level
-	push_msg("Entering level %d.", seed);
+void process_enemies_turn() {
+	PerfScope ps(PH_ENEMIES);
+	with_dims([](auto d) { enemies_turn<decltype(d)>(); });
+}
 
-	int i, j;
-	// Initialize map: outer walls and random interior walls
-	for (j = 0; j < MAPSIZE; j++) {
-		for (i = 0; i < MAPSIZE; i++) {
-			if (i == 0 || i == MAPSIZE-1 || j == 0 || j == MAPSIZE-1) lvl[i][j] = WALL;
-			else lvl[i][j] = (rand() % 10 == 0) ? WALL : 0;
-		}
+// Pick an enemy archetype allowed on this level, weighted by spawn_weight
+int pick_archetype(int lv) {
+	int total = 0;
+	for (int k = 0; k < ENEMY_KINDS; k++)
+		if (lv >= enemy_defs[k].min_level) total += enemy_defs[k].spawn_weight;
+	if (total <= 0) return 0;
+	int r = rnd(gen_rng, total);
+	for (int k = 0; k < ENEMY_KINDS; k++) {
+		if (lv < enemy_defs[k].min_level) continue;
+		r -= enemy_defs[k].spawn_weight;
+		if (r < 0) return k;
 	}
+	return 0;
+}
 
-	// Scatter coins, torches, potions and swords on empty floor tiles (no overlap with walls/items yet)
-	for (int tries = 0; tries < MAPSIZE*MAPSIZE; tries++) {
-		int rx = 1 + rand() % (MAPSIZE-2);
-		int ry = 1 + rand() % (MAPSIZE-2);
-		if (lvl[rx][ry] == 0) {
-			int r = rand() % 100;
-			if (r < 5) lvl[rx][ry] = COIN;            // ~5%
-			else if (r < 8) lvl[rx][ry] = TORCH;     // ~3%
-			else if (r < 10) lvl[rx][ry] = POTION;   // ~2% (reduced)
-			else if (r < 12) lvl[rx][ry] = SWORD_ITEM; // ~2% (reduced)
-		}
+// Apply the item on the player's tile (if any) and remove it from the map
+void pick_up_item() {
+	int item = tile_table.look[tile(x, y)].item;
+	if (item == -1) return;
+	const ItemDef &d = item_defs[item];
+	int amount = roll(d.amount, level, combat_rng);
+	switch (d.effect) {
+		case EFFECT_COINS: coins += amount; break;
+		case EFFECT_TORCH: torch += amount; break;
+		case EFFECT_POTION: potions += amount; break;
+		case EFFECT_SWORD: swordDamage += amount; break;
 	}
+	journal_tile(x * map_stride + y);
+	tile(x, y) &= ~d.tile;
+	update_target(x * map_stride + y);
+	if (d.tile & TORCH) floor_torch_changed(x * map_stride + y, false);
+	emit(EV_PICKUP, item, amount);
+}
 
-	// Choose player start on a non-wall tile (carve if unlucky)
-	int tries = 0;
-	do {
-		x = 1 + rand() % (MAPSIZE-2);
-		y = 1 + rand() % (MAPSIZE-2);
-		tries++;
-	} while ((lvl[x][y] & WALL) && tries < 1000);
-	if (lvl[x][y] & WALL) lvl[x][y] = 0;
+uint64_t level_seed(int lv) {
+	return mix64(run_seed ^ mix64((uint64_t)lv));
+}
 
-	// Choose stairs on a non-wall tile and not overlapping start
-	int sx, sy;
-	tries = 0;
+/// Generates the dungeon map
+// A generator is a table of stage hooks run in order on a wall-filled grid:
+// terrain carves the floor, items scatters loot, connect picks the start and
+// the stairs and makes sure one reaches the other, spawns places enemies.
+// "cave" is the original scattered-walls map; "bsp" splits the map into
+// rooms joined by corridors, O(cells) however large the map.
+enum GenStage { GS_TERRAIN, GS_ITEMS, GS_CONNECT, GS_SPAWNS, GS_COUNT };
+const char *gen_stage_names[GS_COUNT] = { "terrain", "items", "connect", "spawns" };
+
+// Filled in by the stages as they go
+struct GenCtx {
+	int sx, sy; // stairs
+};
+
+template <class D> struct Generator {
+	void (*stage[GS_COUNT])(GenCtx &);
+};
+
+long long now_ns();
+
+// Per-stage time, only collected while gen_timing is set (--bench-gen)
+bool gen_timing = false;
+long long gen_stage_ns[GEN_KINDS][GS_COUNT];
+
+// Which engine builds level lv
+int level_generator(int lv) {
+	if (opt_gen == GEN_MIXED) return lv % 2 ? GEN_CAVE : GEN_BSP;
+	return opt_gen;
+}
+
+// Random interior tile matching the predicate; carved to floor if none turns up
+template <class D, class F> void pick_tile(int *px, int *py, F ok) {
+	int tries = 0;
 	do {
-		sx = 1 + rand() % (MAPSIZE-2);
-		sy = 1 + rand() % (MAPSIZE-2);
+		*px = 1 + rnd(gen_rng, D::w()-2);
+		*py = 1 + rnd(gen_rng, D::h()-2);
 		tries++;
-	} while (((lvl[sx][sy] & WALL) || (sx == x && sy == y)) && tries < 1000);
-	if (lvl[sx][sy] & WALL) lvl[sx][sy] = 0;
-	// Note: do NOT set STAIRS_DOWN yet; carving may overwrite and we'll set it after cleanup
+	} while (!ok(*px, *py) && tries < 1000);
+	if (lvl[D::at(*px, *py)] & WALL) lvl[D::at(*px, *py)] = 0;
+}
 
-	// Ensure connectivity between player and stairs by carving a simple Manhattan path
-	int cx = x, cy = y;
-	while (cx != sx) {
-		if (sx > cx) cx++; else cx--;
-		lvl[cx][cy] = 0;
-	}
-	while (cy != sy) {
-		if (sy > cy) cy++; else cy--;
-		lvl[cx][cy] = 0;
+// Scatter coins, torches, potions and swords on empty floor tiles (no overlap with walls/items yet)
+template <class D> void scatter_items(GenCtx &) {
+	for (int tries = 0; tries < D::w()*D::h(); tries++) {
+		int rx = 1 + rnd(gen_rng, D::w()-2);
+		int ry = 1 + rnd(gen_rng, D::h()-2);
+		if (lvl[D::at(rx, ry)] == 0) {
+			int item = spawn_roll.item[rnd(gen_rng, 100)]; // weights from item_defs
+			if (item != -1) lvl[D::at(rx, ry)] = item_defs[item].tile;
+		}
 	}
+}
 
-	// Remove simple dead-ends to reduce isolated corridors
-	remove_dead_ends();
-
-	// Ensure items do not overlap with start or walls
-	for (j = 1; j < MAPSIZE-1; j++) {
-		for (i = 1; i < MAPSIZE-1; i++) {
-			if (lvl[i][j] & (COIN | TORCH | POTION | SWORD_ITEM)) {
-				if ((lvl[i][j] & WALL) || (i == x && j == y)) {
-					lvl[i][j] &= ~(COIN | TORCH | POTION | SWORD_ITEM);
+// Clear items left on walls or under the player, then set the stairs flag
+template <class D> void place_stairs(GenCtx &g) {
+	for (int j = 1; j < D::h()-1; j++) {
+		for (int i = 1; i < D::w()-1; i++) {
+			if (lvl[D::at(i, j)] & ITEM_TILES) {
+				if ((lvl[D::at(i, j)] & WALL) || (i == x && j == y)) {
+					lvl[D::at(i, j)] &= ~ITEM_TILES;
 				}
 			}
 		}
 	}
-
-	// Place stairs after carving/dead-end removal and ensure no overlap
 	// Clear any item that might overlap the chosen stairs tile, force it to floor, then set the stairs flag
-	lvl[sx][sy] &= ~(COIN | TORCH | POTION | SWORD_ITEM);
-	if (lvl[sx][sy] & WALL) lvl[sx][sy] = 0;
-	lvl[sx][sy] |= STAIRS_DOWN;
+	lvl[D::at(g.sx, g.sy)] &= ~ITEM_TILES;
+	if (lvl[D::at(g.sx, g.sy)] & WALL) lvl[D::at(g.sx, g.sy)] = 0;
+	lvl[D::at(g.sx, g.sy)] |= STAIRS_DOWN;
+}
 
-	// Spawn enemies for this level
+// Spawn enemies for this level
+template <class D> void spawn_enemies(GenCtx &g) {
 	enemies.clear();
-	int enemy_count = rand() % (1 + level); // may be zero
+	int enemy_count = opt_enemies >= 0 ? opt_enemies : roll(enemy_count_curve, level, gen_rng); // may be zero
+	enemies.reserve(enemy_count);
 	for (int e = 0; e < enemy_count; e++) {
 		int ex = 0, ey = 0, etries = 0;
+		bool free_tile;
 		do {
-			ex = 1 + rand() % (MAPSIZE-2);
-			ey = 1 + rand() % (MAPSIZE-2);
+			ex = 1 + rnd(gen_rng, D::w()-2);
+			ey = 1 + rnd(gen_rng, D::h()-2);
 			etries++;
-		} while ((lvl[ex][ey] != 0) || (ex == x && ey == y) || (ex == sx && ey == sy) || (enemy_at(ex, ey) != -1 && etries < 200));
-		if (etries >= 200) continue;
+			free_tile = lvl[D::at(ex, ey)] == 0 && !(ex == x && ey == y) && !(ex == g.sx && ey == g.sy) && enemy_at(ex, ey) == -1;
+		} while (!free_tile && etries < 200);
+		if (!free_tile) continue;
 		Enemy ne;
+		ne.kind = pick_archetype(level);
+		const EnemyArchetype &a = enemy_defs[ne.kind];
 		ne.x = ex; ne.y = ey;
 		// scale enemy HP/damage with level and add variability
-		ne.hp = 2 + rand() % (3 + level);
+		ne.hp = roll(a.hp, level, gen_rng);
 		ne.max_hp = ne.hp;
-		ne.damage = 1 + rand() % (1 + (level/2));
+		ne.damage = roll(a.damage, level, gen_rng);
 		ne.active = false; ne.defending = false; ne.alive = true;
 		// Precompute drops to show in HUD and give on death
-		ne.coins_drop = 1 + rand() % (1 + level/2 + 1); // 1..(1+level/2+1)
-		ne.potions_drop = (rand() % 10 == 0) ? 1 : 0; // ~10% chance
-		ne.torch_drop = rand() % (1 + level/2 + 2);
-		ne.hp_drop = 1 + rand() % (1 + level/2);
+		ne.coins_drop = roll(a.coins, level, gen_rng);
+		ne.potions_drop = roll(a.potions, level, gen_rng);
+		ne.torch_drop = roll(a.torch, level, gen_rng);
+		ne.hp_drop = roll(a.heal, level, gen_rng);
 		enemies.push_back(ne);
 	}
 }
 
+// cave: about one interior tile in ten is wall
+template <class D> void cave_terrain(GenCtx &) {
+	for (int j = 1; j < D::h()-1; j++) {
+		for (int i = 1; i < D::w()-1; i++) {
+			lvl[D::at(i, j)] = (rnd(gen_rng, 10) == 0) ? WALL : 0;
+		}
+	}
+}
+
+template <class D> void cave_connect(GenCtx &g) {
+	// Choose player start on a non-wall tile (carve if unlucky)
+	pick_tile<D>(&x, &y, [](int px, int py) { return !(lvl[D::at(px, py)] & WALL); });
+	// Choose stairs on a non-wall tile and not overlapping start
+	pick_tile<D>(&g.sx, &g.sy, [](int px, int py) { return !(lvl[D::at(px, py)] & WALL) && !(px == x && py == y); });
+	// Note: do NOT set STAIRS_DOWN yet; carving may overwrite and we'll set it after cleanup
+	build_stairs_dist<D>(g.sx, g.sy);
+
+	// Ensure connectivity between player and stairs by carving a simple Manhattan path
+	int cx = x, cy = y;
+	while (cx != g.sx) {
+		if (g.sx > cx) cx++; else cx--;
+		carve<D>(D::at(cx, cy));
+	}
+	while (cy != g.sy) {
+		if (g.sy > cy) cy++; else cy--;
+		carve<D>(D::at(cx, cy));
+	}
+
+	// Remove simple dead-ends to reduce isolated corridors
+	{
+		PerfScope ps(PH_DEAD_ENDS);
+		remove_dead_ends<D>();
+	}
+	place_stairs<D>(g);
+}
+
+// bsp: leaves are at least BSP_MIN_LEAF tiles on a side and hold one room
+// each, leaving their last row and column as wall between neighbours
+#define BSP_MIN_LEAF 5
+
+template <class D> void carve_line(int x0, int y0, int x1, int y1) {
+	for (int i = min(x0, x1); i <= std::max(x0, x1); i++) lvl[D::at(i, y0)] = 0;
+	for (int j = min(y0, y1); j <= std::max(y0, y1); j++) lvl[D::at(x1, j)] = 0;
+}
+
+// Rooms for the leaves under [x0,x1]x[y0,y1]; returns a floor tile in one of
+// them and joins the two halves of every split with an L-shaped corridor
+template <class D> void bsp_split(int x0, int y0, int x1, int y1, int *cx, int *cy) {
+	int w = x1 - x0 + 1, h = y1 - y0 + 1;
+	bool vertical = w >= h; // cut across the longer side
+	int len = vertical ? w : h;
+	if (len < 2 * BSP_MIN_LEAF) {
+		// leaf: a room of at least 2x2 with its corner somewhere in the leaf
+		int rw = 2 + rnd(gen_rng, w - 2), rh = 2 + rnd(gen_rng, h - 2);
+		if (rw > w - 1) rw = std::max(1, w - 1);
+		if (rh > h - 1) rh = std::max(1, h - 1);
+		int rx = x0 + rnd(gen_rng, w - rw), ry = y0 + rnd(gen_rng, h - rh);
+		for (int i = rx; i < rx + rw; i++)
+			for (int j = ry; j < ry + rh; j++) lvl[D::at(i, j)] = 0;
+		*cx = rx + rw / 2; *cy = ry + rh / 2;
+		return;
+	}
+	int cut = BSP_MIN_LEAF + rnd(gen_rng, len - 2 * BSP_MIN_LEAF + 1);
+	int ax, ay, bx, by;
+	if (vertical) {
+		bsp_split<D>(x0, y0, x0 + cut - 1, y1, &ax, &ay);
+		bsp_split<D>(x0 + cut, y0, x1, y1, &bx, &by);
+	} else {
+		bsp_split<D>(x0, y0, x1, y0 + cut - 1, &ax, &ay);
+		bsp_split<D>(x0, y0 + cut, x1, y1, &bx, &by);
+	}
+	carve_line<D>(ax, ay, bx, by);
+	if (rnd(gen_rng, 2)) { *cx = ax; *cy = ay; } else { *cx = bx; *cy = by; }
+}
+
+template <class D> void bsp_terrain(GenCtx &) {
+	int cx, cy;
+	// the last interior row and column stay wall like every leaf's
+	bsp_split<D>(1, 1, D::w() - 1, D::h() - 1, &cx, &cy);
+}
+
+// Every room is already reachable, so only the endpoints need choosing
+template <class D> void bsp_connect(GenCtx &g) {
+	pick_tile<D>(&x, &y, [](int px, int py) { return !(lvl[D::at(px, py)] & WALL); });
+	pick_tile<D>(&g.sx, &g.sy, [](int px, int py) { return !(lvl[D::at(px, py)] & WALL) && !(px == x && py == y); });
+	build_stairs_dist<D>(g.sx, g.sy);
+	place_stairs<D>(g);
+}
+
+template <class D> const Generator<D> generators[GEN_KINDS] = {
+	{ { cave_terrain<D>, scatter_items<D>, cave_connect<D>, spawn_enemies<D> } },
+	{ { bsp_terrain<D>, scatter_items<D>, bsp_connect<D>, spawn_enemies<D> } },
+};
+
+template <class D> GenCtx gen_level(int seed) {
+	// Seed RNG from the run seed and level so a seed replays the same dungeon
+	seed_rng(level_seed(seed));
+	// Message: entering level
+	emit(EV_LEVEL, 0, seed);
+
+	// Start from an empty arena: the previous level's grid and enemies go at once
+	enemies = std::pmr::vector<Enemy>(&arena_router);
+	level_arena->reset();
+	// Columns -1..w; +1 for the top sentinel of column -1
+	map_stride = D::stride();
+	size_t cells = (size_t)(D::w() + 2) * D::stride() + 1;
+	tile_t *grid = level_alloc<tile_t>(cells);
+	lvl = grid + D::stride() + 1;
+	// Sentinels, outer walls and solid rock for the terrain stage to carve
+	memset(grid, WALL, cells);
+
+	int kind = level_generator(seed);
+	const Generator<D> &engine = generators<D>[kind];
+	GenCtx g;
+	g.sx = g.sy = 0;
+	for (int st = 0; st < GS_COUNT; st++) {
+		long long t0 = gen_timing ? now_ns() : 0;
+		engine.stage[st](g);
+		if (gen_timing) gen_stage_ns[kind][st] += now_ns() - t0;
+	}
+
+	init_exploration<D>();
+	return g;
+}
+
+/// Level pack
+// --pack=PATH keeps generated levels in a file keyed by (run seed, level).
+// gen() maps a stored level's tile grid straight into lvl through a private
+// copy-on-write mapping, so playing never writes the file, and only rebuilds
+// the distance field and exploration state; a level missing from the pack is
+// generated as usual and appended. The file is a header, level records and
+// two index regions of (seed, level, offset) sorted by key: the live index and
+// a spare. Appends hold flock(LOCK_EX), so games sharing a pack take turns:
+// records go after everything in the file, the new index into the spare region
+// and the header is switched over last, so a reader or a crash never sees a
+// half-written index; the old live region is the next spare. A region too
+// small for the index is abandoned for one of twice the size at the end of
+// the file, which keeps the dead space within the size of the index.
+// --build-pack=PATH fills a pack with levels 1..--pack-levels of --seed on
+// --threads workers. A pack only fits the map size, generator and enemy count
+// it was built with.
+#define PACK_MAGIC 0x4b504c52u // "RLPK"
+#define PACK_ALIGN 16
+
+#define PACK_VERSION 3
+#define PACK_MIN_INDEX 64 // entries in the first index regions
+
+struct PackHeader {
+	uint32_t magic, version;
+	int32_t w, h, stride, gen, enemies, pad;
+	uint64_t index_offset, count, index_cap; // live index: count of index_cap entries
+	uint64_t spare_offset, spare_cap;        // region the next commit writes
+	uint64_t end;                            // next record or region goes here
+};
+
+struct PackEntry {
+	uint64_t seed;
+	int32_t level;
+	uint32_t size;
+	uint64_t offset;
+	bool operator<(const PackEntry &o) const { return seed != o.seed ? seed < o.seed : level < o.level; }
+};
+
+// Record header; the sentinel-bordered grid and then the enemies follow it
+struct PackLevel {
+	int32_t x, y, sx, sy;
+	uint32_t cells, nenemies;
+	uint64_t gen_pos, combat_pos; // RNG positions once the level was generated
+};
+
+// Serialize the level just generated on this thread
+void pack_record(const GenCtx &g, std::string &out) {
+	PackLevel r;
+	r.x = x; r.y = y; r.sx = g.sx; r.sy = g.sy;
+	r.cells = (uint32_t)((map_w + 2) * map_stride + 1);
+	r.nenemies = (uint32_t)enemies.size();
+	r.gen_pos = gen_rng.pos; r.combat_pos = combat_rng.pos;
+	out.assign((const char *)&r, sizeof(r));
+	out.append((const char *)(lvl - map_stride - 1), r.cells * sizeof(tile_t));
+	out.append((const char *)enemies.data(), enemies.size() * sizeof(Enemy));
+}
+
+#ifndef _WIN32
+struct LevelPack {
+	int fd = -1;
+	PackHeader h;
+	std::vector<PackEntry> index; // sorted
+	uint64_t end = 0;             // next record goes here, past everything in h
+	void *map = NULL;             // mapping behind the current level's grid
+	size_t map_len = 0;
+	long long hits = 0, misses = 0;
+
+	~LevelPack() { unmap(); if (fd >= 0) close(fd); }
+
+	bool open(const std::string &path) {
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) { perror(path.c_str()); return false; }
+		flock(fd, LOCK_EX); // the first game to open a new pack writes its header
+		bool ok = check(path);
+		flock(fd, LOCK_UN);
+		return ok;
+	}
+
+	// Header and index of an open pack, or a fresh header for an empty file
+	bool check(const std::string &path) {
+		PackHeader want;
+		memset(&want, 0, sizeof(want));
+		want.magic = PACK_MAGIC; want.version = PACK_VERSION;
+		want.w = map_w; want.h = map_h; want.gen = opt_gen; want.enemies = opt_enemies;
+		with_dims([&want](auto d) { want.stride = decltype(d)::stride(); });
+		if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+			h = want;
+			end = h.end = (sizeof(h) + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+			return write_index();
+		}
+		if (h.magic != PACK_MAGIC) { fprintf(stderr, "%s: not a level pack\n", path.c_str()); return false; }
+		if (h.version != PACK_VERSION) { fprintf(stderr, "%s: level pack from another version; delete it to rebuild\n", path.c_str()); return false; }
+		if (h.w != want.w || h.h != want.h || h.stride != want.stride || h.gen != want.gen || h.enemies != want.enemies) {
+			fprintf(stderr, "%s: built for a %dx%d map, generator %d, enemies %d\n", path.c_str(), h.w, h.h, h.gen, h.enemies);
+			return false;
+		}
+		if (!reload()) { fprintf(stderr, "%s: truncated index\n", path.c_str()); return false; }
+		return true;
+	}
+
+	// Header and index as they are on disk now
+	bool reload() {
+		if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) return false;
+		index.resize(h.count);
+		size_t bytes = index.size() * sizeof(PackEntry);
+		if (bytes && pread(fd, index.data(), bytes, h.index_offset) != (ssize_t)bytes) return false;
+		end = h.end;
+		return true;
+	}
+
+	const PackEntry *find(uint64_t seed, int lv) const {
+		PackEntry k;
+		k.seed = seed; k.level = lv;
+		std::vector<PackEntry>::const_iterator it = std::lower_bound(index.begin(), index.end(), k);
+		return it != index.end() && it->seed == seed && it->level == lv ? &*it : NULL;
+	}
+
+	// Index into the spare region, then the header making it the live one
+	bool write_index() {
+		size_t bytes = index.size() * sizeof(PackEntry);
+		uint64_t at = h.spare_offset, cap = h.spare_cap;
+		if (index.size() > cap) {
+			cap = std::max<uint64_t>(PACK_MIN_INDEX, 2 * index.size());
+			at = end;
+			end += cap * sizeof(PackEntry);
+			if (ftruncate(fd, (off_t)end) != 0) return false; // later records go past the whole region
+		}
+		if (bytes && pwrite(fd, index.data(), bytes, at) != (ssize_t)bytes) return false;
+		h.spare_offset = h.index_offset; h.spare_cap = h.index_cap;
+		h.index_offset = at; h.index_cap = cap;
+		h.count = index.size();
+		h.end = end;
+		return pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+	}
+
+	// Lock the pack for appends and pick up what other games have added
+	bool begin() {
+		if (flock(fd, LOCK_EX) == 0 && reload()) return true;
+		flock(fd, LOCK_UN);
+		return false;
+	}
+
+	// Between begin() and commit(); a level already in the pack is skipped
+	bool append(uint64_t seed, int lv, const std::string &rec) {
+		if (find(seed, lv)) return true;
+		if (pwrite(fd, rec.data(), rec.size(), end) != (ssize_t)rec.size()) return false;
+		PackEntry e;
+		e.seed = seed; e.level = lv; e.size = (uint32_t)rec.size(); e.offset = end;
+		index.insert(std::upper_bound(index.begin(), index.end(), e), e);
+		end += (rec.size() + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+		return true;
+	}
+
+	// Publish the appends, if any, and unlock
+	bool commit() {
+		bool ok = index.size() == h.count || write_index();
+		flock(fd, LOCK_UN);
+		return ok;
+	}
+
+	// Private writable mapping of one record; stays valid until unmap(). A
+	// record past the end of a truncated file is refused rather than mapped
+	// into a SIGBUS.
+	uint8_t *map_record(const PackEntry &e) {
+		unmap();
+		struct stat st;
+		if (fstat(fd, &st) != 0 || e.offset + e.size > (uint64_t)st.st_size) return NULL;
+		uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+		uint64_t base = e.offset & ~(page - 1);
+		map_len = (size_t)(e.offset - base + e.size);
+		map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)base);
+		if (map == MAP_FAILED) { map = NULL; return NULL; }
+		return (uint8_t *)map + (e.offset - base);
+	}
+
+	void unmap() {
+		if (map) munmap(map, map_len);
+		map = NULL;
+	}
+};
+
+thread_local LevelPack *level_pack = NULL; // only the game thread uses a pack
+
+// The counterpart of gen_level() for a stored level
+template <class D> bool pack_load(int lv) {
+	level_pack->unmap();
+	const PackEntry *e = level_pack->find(run_seed, lv);
+	uint8_t *p = e ? level_pack->map_record(*e) : NULL;
+	if (!p) { level_pack->misses++; return false; }
+	PackLevel r;
+	memcpy(&r, p, sizeof(r));
+	emit(EV_LEVEL, 0, lv);
+	enemies = std::pmr::vector<Enemy>(&arena_router);
+	level_arena->reset();
+	map_stride = D::stride();
+	lvl = (tile_t *)(p + sizeof(r)) + D::stride() + 1;
+	x = r.x; y = r.y;
+	enemies.resize(r.nenemies);
+	if (r.nenemies) memcpy(enemies.data(), p + sizeof(r) + r.cells * sizeof(tile_t), r.nenemies * sizeof(Enemy));
+	build_stairs_dist<D>(r.sx, r.sy);
+	init_exploration<D>();
+	seed_rng(level_seed(lv));
+	gen_rng.pos = r.gen_pos; combat_rng.pos = r.combat_pos;
+	level_pack->hits++;
+	return true;
+}
+
+void pack_store(int lv, const GenCtx &g) {
+	std::string rec;
+	pack_record(g, rec);
+	if (!level_pack->begin()) { perror("level pack"); return; }
+	bool ok = level_pack->append(run_seed, lv, rec);
+	if (!level_pack->commit() || !ok) perror("level pack");
+}
+
+// --build-pack: generate the missing levels in parallel, append them in order
+bool build_pack() {
+	LevelPack pack;
+	if (!pack.open(opt_build_pack)) return false;
+	int nthreads = opt_threads > 0 ? opt_threads : (int)std::thread::hardware_concurrency();
+	if (nthreads < 1) nthreads = 1;
+	int n = opt_pack_levels;
+	uint64_t seed = run_seed;
+	std::vector<std::string> recs(n + 1);
+	std::atomic<int> next{1};
+	long long t0 = now_ns();
+	std::vector<std::thread> workers;
+	for (int i = 0; i < nthreads; i++) {
+		workers.emplace_back([&] {
+			run_seed = seed;
+			for (int lv; (lv = next.fetch_add(1)) <= n; ) {
+				if (pack.find(seed, lv)) continue;
+				level = lv;
+				with_dims([lv, &recs](auto d) { pack_record(gen_level<decltype(d)>(lv), recs[lv]); });
+			}
+		});
+	}
+	for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+	double gen_secs = (now_ns() - t0) / 1e9;
+	if (!pack.begin()) { perror(opt_build_pack.c_str()); return false; }
+	size_t before = pack.index.size();
+	bool ok = true;
+	for (int lv = 1; lv <= n && ok; lv++)
+		if (!recs[lv].empty()) ok = pack.append(seed, lv, recs[lv]);
+	if (!pack.commit() || !ok) { perror(opt_build_pack.c_str()); return false; }
+	int added = (int)(pack.index.size() - before);
+	printf("pack %s: %d levels added for seed %llu (%d already there), %zu total, %llu bytes\n",
+		opt_build_pack.c_str(), added, (unsigned long long)seed, n - added, pack.index.size(),
+		(unsigned long long)pack.end);
+	printf("generated on %d threads in %.3fs, written in %.3fs\n", nthreads, gen_secs, (now_ns() - t0) / 1e9 - gen_secs);
+	return true;
+}
+#else
+struct LevelPack {
+	long long hits = 0, misses = 0;
+	bool open(const std::string &) { fprintf(stderr, "level packs need mmap\n"); return false; }
+};
+thread_local LevelPack *level_pack = NULL;
+template <class D> bool pack_load(int) { return false; }
+void pack_store(int, const GenCtx &) {}
+bool build_pack() { fprintf(stderr, "level packs need mmap\n"); return false; }
+#endif
+
+void gen(int seed) {
+	PerfScope ps(PH_GEN);
+	with_dims([seed](auto d) {
+		if (level_pack && pack_load<decltype(d)>(seed)) return;
+		GenCtx g = gen_level<decltype(d)>(seed);
+		if (level_pack) pack_store(seed, g);
+	});
+	if (seed > 1) tile(x, y) |= STAIRS_UP; // where the player arrives from above
+}
+
+/// Level store
+// Levels the player has left stay in memory so the stairs up lead back to
+// them as they were. Only the active level is laid out in the arena; leaving
+// one squeezes it into a blob: one bit plane per tile flag plus one for what
+// has been seen, each PackBits-style run-length coded (most planes are a
+// single run of zeros), then the living enemies in 18 bytes each. Coming
+// back decodes the blob into a fresh arena and rebuilds the distance field,
+// light and exploration state as gen() does. The store holds at most
+// --level-store KB; past that the level left longest ago is dropped and is
+// generated afresh should the player climb back to it. 0 keeps nothing, the
+// default for --simulate and batch environments.
+struct PackedEnemy {
+	uint8_t kind, x, y, flags; // flags: 1 active, 2 defending
+	int16_t hp, max_hp, damage;
+	int16_t coins_drop, potions_drop, torch_drop, hp_drop;
+};
+static_assert(sizeof(PackedEnemy) == 18, "PackedEnemy is 18 bytes");
+
+struct StoredLevel {
+	int level;
+	long long left;   // store clock when the player left it
+	std::string data; // planes, then the enemy table
+};
+
+const tile_t store_planes[] = { WALL, COIN, STAIRS_DOWN, STAIRS_UP, TORCH, POTION, SWORD_ITEM };
+constexpr int STORE_PLANES = sizeof(store_planes) / sizeof(store_planes[0]); // + the seen plane
+
+thread_local std::vector<StoredLevel> level_store;
+thread_local size_t level_store_bytes = 0;
+thread_local long long level_store_clock = 0;
+thread_local long long level_store_dropped = 0;
+
+void store_clear() {
+	level_store.clear();
+	level_store_bytes = 0;
+}
+
+// A control byte c < 128 is followed by c + 1 literal bytes; c >= 128 by
+// one byte repeated c - 125 times (3..130)
+void rle_put(std::string &out, const uint8_t *p, int n) {
+	for (int i = 0; i < n; ) {
+		int run = 1;
+		while (i + run < n && run < 130 && p[i + run] == p[i]) run++;
+		if (run >= 3) {
+			out += (char)(run + 125); out += (char)p[i];
+			i += run;
+			continue;
+		}
+		int lit = 1; // up to the next run of three
+		while (i + lit < n && lit < 128 && !(i + lit + 2 < n && p[i + lit] == p[i + lit + 1] && p[i + lit] == p[i + lit + 2])) lit++;
+		out += (char)(lit - 1); out.append((const char *)p + i, lit);
+		i += lit;
+	}
+}
+
+// Decode n bytes; returns the input consumed
+size_t rle_get(const uint8_t *in, uint8_t *out, int n) {
+	const uint8_t *p = in;
+	for (int i = 0; i < n; ) {
+		int c = *p++;
+		if (c >= 128) { memset(out + i, *p++, c - 125); i += c - 125; }
+		else { memcpy(out + i, p, c + 1); p += c + 1; i += c + 1; }
+	}
+	return p - in;
+}
+
+// Compress the active level into the store, dropping the stalest over budget
+template <class D> void store_level(int lv) {
+	StoredLevel s;
+	s.level = lv;
+	s.left = ++level_store_clock;
+	const int bytes = (D::w() * D::h() + 7) / 8;
+	uint8_t bits[(MAP_MAX * MAP_MAX + 7) / 8];
+	for (int p = 0; p <= STORE_PLANES; p++) {
+		memset(bits, 0, bytes);
+		int t = 0;
+		for (int i = 0; i < D::w(); i++)
+			for (int j = 0; j < D::h(); j++, t++) {
+				int c = D::at(i, j);
+				bool on = p < STORE_PLANES ? (lvl[c] & store_planes[p]) != 0 : seen[c] != 0;
+				bits[t >> 3] |= (uint8_t)(on << (t & 7));
+			}
+		rle_put(s.data, bits, bytes);
+	}
+	for (size_t e = 0; e < enemies.size(); e++) {
+		const Enemy &en = enemies[e];
+		if (!en.alive) continue;
+		PackedEnemy pe = { (uint8_t)en.kind, (uint8_t)en.x, (uint8_t)en.y,
+			(uint8_t)(en.active | en.defending << 1),
+			(int16_t)en.hp, (int16_t)en.max_hp, (int16_t)en.damage,
+			(int16_t)en.coins_drop, (int16_t)en.potions_drop, (int16_t)en.torch_drop, (int16_t)en.hp_drop };
+		s.data.append((const char *)&pe, sizeof(pe));
+	}
+	s.data.shrink_to_fit();
+	level_store_bytes += sizeof(StoredLevel) + s.data.size();
+	level_store.push_back(std::move(s));
+	while (level_store_bytes > (size_t)opt_level_store_kb * 1024 && !level_store.empty()) {
+		size_t old = 0;
+		for (size_t i = 1; i < level_store.size(); i++)
+			if (level_store[i].left < level_store[old].left) old = i;
+		level_store_bytes -= sizeof(StoredLevel) + level_store[old].data.size();
+		level_store[old] = std::move(level_store.back());
+		level_store.pop_back();
+		level_store_dropped++;
+	}
+}
+
+// The counterpart of store_level(); the player arrives on the stairs they
+// came through: the stairs up when coming from above, else the stairs down
+template <class D> bool store_load(int lv, bool from_above) {
+	size_t k = 0;
+	while (k < level_store.size() && level_store[k].level != lv) k++;
+	if (k == level_store.size()) return false;
+	StoredLevel s = std::move(level_store[k]);
+	level_store[k] = std::move(level_store.back());
+	level_store.pop_back();
+	level_store_bytes -= sizeof(StoredLevel) + s.data.size();
+	emit(EV_LEVEL, 0, lv);
+
+	enemies = std::pmr::vector<Enemy>(&arena_router);
+	level_arena->reset();
+	map_stride = D::stride();
+	size_t cells = (size_t)(D::w() + 2) * D::stride() + 1;
+	tile_t *grid = level_alloc<tile_t>(cells);
+	lvl = grid + D::stride() + 1;
+	memset(grid, WALL, cells);
+	for (int i = 0; i < D::w(); i++) memset(&lvl[D::at(i, 0)], 0, D::h());
+
+	const int bytes = (D::w() * D::h() + 7) / 8;
+	uint8_t bits[(MAP_MAX * MAP_MAX + 7) / 8], seen_bits[(MAP_MAX * MAP_MAX + 7) / 8];
+	const uint8_t *in = (const uint8_t *)s.data.data();
+	int sx = 0, sy = 0, ux = 0, uy = 0;
+	for (int p = 0; p < STORE_PLANES; p++) {
+		in += rle_get(in, bits, bytes);
+		for (int b = 0; b < bytes; b++) {
+			if (!bits[b]) continue;
+			for (int k = 0; k < 8; k++) {
+				if (!(bits[b] >> k & 1)) continue;
+				int t = b * 8 + k;
+				int i = t / D::h(), j = t % D::h();
+				lvl[D::at(i, j)] |= store_planes[p];
+				if (store_planes[p] == STAIRS_DOWN) { sx = i; sy = j; }
+				if (store_planes[p] == STAIRS_UP) { ux = i; uy = j; }
+			}
+		}
+	}
+	in += rle_get(in, seen_bits, bytes);
+	const uint8_t *end = (const uint8_t *)s.data.data() + s.data.size();
+	enemies.resize((end - in) / sizeof(PackedEnemy));
+	for (size_t e = 0; e < enemies.size(); e++, in += sizeof(PackedEnemy)) {
+		PackedEnemy pe;
+		memcpy(&pe, in, sizeof(pe));
+		Enemy &en = enemies[e];
+		en.kind = pe.kind; en.x = pe.x; en.y = pe.y;
+		en.hp = pe.hp; en.max_hp = pe.max_hp; en.damage = pe.damage;
+		en.active = pe.flags & 1; en.defending = (pe.flags & 2) != 0; en.alive = true;
+		en.coins_drop = pe.coins_drop; en.potions_drop = pe.potions_drop;
+		en.torch_drop = pe.torch_drop; en.hp_drop = pe.hp_drop;
+	}
+
+	x = from_above ? ux : sx;
+	y = from_above ? uy : sy;
+	build_stairs_dist<D>(sx, sy);
+	init_exploration<D>();
+	// what was seen before counts as freshly lit, once
+	for (int b = 0; b < bytes; b++) {
+		if (!seen_bits[b]) continue;
+		for (int k = 0; k < 8; k++) {
+			if (!(seen_bits[b] >> k & 1)) continue;
+			int t = b * 8 + k;
+			int c = D::at(t / D::h(), t % D::h());
+			if (seen[c]) continue;
+			seen[c] = 2;
+			dist_queue[light_fresh++] = c;
+		}
+	}
+	light_settle();
+	return true;
+}
+
+// Take the stairs from the current level to lv, one up or one down
+void change_level(int lv) {
+	bool down = lv > level;
+	int from = level;
+	if (opt_level_store_kb > 0) with_dims([from](auto d) { store_level<decltype(d)>(from); });
+	level = lv;
+	if (lv > deepest_level) deepest_level = lv;
+	bool stored = false;
+	with_dims([&](auto d) { stored = store_load<decltype(d)>(lv, down); });
+	if (stored) return;
+	gen(lv);
+	if (down) return;
+	// back up to a level the store had dropped: arrive on its stairs down
+	for (int i = 0; i < map_w; i++)
+		for (int j = 0; j < map_h; j++)
+			if (tile(i, j) & STAIRS_DOWN) { x = i; y = j; }
+	reveal();
+}
+
+/// Frame buffer
+// draw() composes the whole frame here and writes it out in one go. Colors go
+// through the pre-encoded per-terminal escapes in TermCaps and are skipped when
+// unchanged; on pipes and files (tty == 0) only glyphs are written.
+std::string frame;
+TermCaps *caps = termCaps();
+
+void fb_printf(const char *fmt, ...) {
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n > 0) frame.append(buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+}
+
+void fb_color(int c) {
+	frame += nextColorSeq(c);
+}
+
+// Colour c dimmed for a tile with light l (> 0). Below LIGHT_FULL the RGB is
+// scaled down; rlutil degrades it to what the terminal shows. Terminals with
+// fewer than 256 colours only get the dark twin of bright colours.
+void fb_shade(int c, unsigned l) {
+	if (l >= LIGHT_FULL || c < 0) { fb_color(c); return; }
+	if (caps->colors < 256) { fb_color(c > DARKGREY && l * 2 < LIGHT_FULL ? c - 8 : c); return; }
+	unsigned char rgb[3];
+	getColorRGB(c, rgb);
+	unsigned k = (l + 1) * 256 / (LIGHT_FULL + 1);
+	char buf[32];
+	frame.append(buf, formatColorRGB(buf, rgb[0] * k >> 8, rgb[1] * k >> 8, rgb[2] * k >> 8));
+}
+
+void fb_locate(int col, int row) {
+	if (caps->tty) fb_printf("\033[%d;%dH", row, col);
+}
+
+void fb_flush() {
+	fwrite(frame.data(), 1, frame.size(), stdout);
+	fflush(stdout);
+	frame.clear();
+}
+
+// Scroll the message log down by the messages pushed since the last frame.
+// The log shares rows 2..15 with the map, so this runs before the map is
+// repainted; the rows it drags along get overwritten right after.
+void scroll_msglog() {
+	unsigned long fresh = msg_count - msg_drawn;
+	if (fresh == 0) return;
+	int n = fresh < MSGLOG_LINES ? (int)fresh : MSGLOG_LINES;
+	fb_color(GREY);
+	if (n < MSGLOG_LINES) {
+		fb_printf("\033[2;%dr", 1 + MSGLOG_LINES); // scroll region = log rows
+		fb_locate(1, 2);
+		fb_printf("\033[%dL", n);
+		frame += ANSI_SCROLL_REGION_RESET;
+	}
+	for (int m = 0; m < n; m++) {
+		fb_locate(map_w + 5, 2 + m);
+		if (m < (int)msglog.size()) frame += msglog[m];
+		if (n == MSGLOG_LINES) frame += "\033[K"; // whole log replaced, clear old tails
+	}
+}
+
+// Leave the alternate screen; safe to call more than once
+void restore_terminal() {
+	if (!term_alt) return;
+	resetScrollRegion();
+	resetColor();
+	showcursor();
+	leaveAltScreen();
+	fflush(stdout);
+	term_alt = false;
+}
+
+// What restore_terminal() prints, written in one go: a signal handler may
+// not touch stdio, which the interrupted code could be in the middle of
+void on_fatal_signal(int sig) {
+#ifndef _WIN32
+	static const char restore[] = "\033[r\033[0m\033[?25h\033[?1049l";
+	if (term_alt && write(STDOUT_FILENO, restore, sizeof(restore) - 1) < 0) {}
+#else
+	restore_terminal();
+#endif
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
 /// Draws the screen
-void draw() {
-	cls();
-	locate(1, 1);
+// Build the next frame in the frame buffer without writing it
+void compose_frame() {
+	PerfScope ps(PH_DRAW);
+	if (term_sync) frame += ANSI_SYNC_BEGIN;
+	if (caps->tty && (!term_alt || full_redraw)) { frame += ANSI_CLS; frame += ANSI_CURSOR_HOME; }
+	else if (term_alt) scroll_msglog();
+	fb_locate(1, 1);
 	int i, j;
-	for (j = 0; j < MAPSIZE; j++) {
-		for (i = 0; i < MAPSIZE; i++) {
-			int ei = enemy_at(i, j);
-			if (0); //(i == x && j == y) printf("@");
-			else if (abs(x-i)+abs(y-j)>min(10,torch/2)) printf(" ");
-			else if (ei != -1 && enemies[ei].alive) { setColor(RED); printf("E"); }
-			else if (lvl[i][j] == 0) { setColor(BLUE); printf("."); }
-			else if (lvl[i][j] & WALL) { setColor(CYAN); printf("#"); }
-			else if (lvl[i][j] & COIN) { setColor(YELLOW); printf("o"); }
-			else if (lvl[i][j] & STAIRS_DOWN) { setColor(GREEN); printf("<"); }
-			else if (lvl[i][j] & TORCH) { setColor(LIGHTRED); printf("f"); }
-			else if (lvl[i][j] & POTION) { setColor(MAGENTA); printf("P"); }
-			else if (lvl[i][j] & SWORD_ITEM) { setColor(LIGHTCYAN); printf("S"); }
+	// Mark living enemies once so the cell loop is a plain table lookup
+	static tile_t overlay[MAP_MAX * MAP_MAX];
+	memset(overlay, 0, map_w * map_h);
+	for (size_t e = 0; e < enemies.size(); e++)
+		if (enemies[e].alive) overlay[enemies[e].x * map_h + enemies[e].y] = ENEMY_MARK;
+	char glyph[MAP_MAX];
+	int color[MAP_MAX];
+	unsigned lum[MAP_MAX];
+	for (j = 0; j < map_h; j++) {
+		// only lit tiles show, dimmer towards the edge of the light
+		for (i = 0; i < map_w; i++) {
+			lum[i] = light[i * map_stride + j] + carried_light(i, j);
+			if (!lum[i]) { glyph[i] = ' '; color[i] = -1; continue; }
+			const TileLook &l = tile_table.look[tile(i, j) | overlay[i * map_h + j]];
+			glyph[i] = l.glyph;
+			color[i] = l.color;
 		}
-		printf("\n");
+		if (j == y) { glyph[x] = '@'; color[x] = WHITE; lum[x] = LIGHT_FULL; }
+		for (i = 0; i < map_w; i++) {
+			fb_shade(color[i], lum[i]);
+			frame += glyph[i];
+		}
+		frame += '\n';
 	}
-	locate(x+1, y+1);
-	setColor(WHITE);
-	printf("@");
-	fflush(stdout);
 
 	// HUD below the map
-	locate(1, MAPSIZE + 2);
-	setColor(LIGHTMAGENTA);
-	printf("Level: %d\n", level);
-	setColor(CYAN);
-	printf("%-20s %20s\n", "me", "Enemies");
+	if (caps->tty) fb_locate(1, map_h + 2);
+	else frame += '\n';
+	fb_color(LIGHTMAGENTA);
+	fb_printf("Level: %d\n", level);
+	fb_color(CYAN);
+	fb_printf("%-20s %20s\n", "me", "Enemies");
 	int ae = adjacent_enemy_index();
 	char lbuf[64], rbuf[64];
 	// HP
 	sprintf(lbuf, "HP: %d/%d", hp, max_hp);
 	if (ae != -1) sprintf(rbuf, "HP: %d/%d", enemies[ae].hp, enemies[ae].max_hp); else sprintf(rbuf, "HP: -/-");
-	setColor(GREEN);
-	printf("%-20s %20s\n", lbuf, rbuf);
+	fb_color(GREEN);
+	fb_printf("%-20s %20s\n", lbuf, rbuf);
 	// Sword
 	sprintf(lbuf, "Sword: %d", swordDamage);
 	if (ae != -1) sprintf(rbuf, "Sword: %d", enemies[ae].damage); else sprintf(rbuf, "Sword: -");
-	setColor(LIGHTCYAN);
-	printf("%-20s %20s\n", lbuf, rbuf);
+	fb_color(LIGHTCYAN);
+	fb_printf("%-20s %20s\n", lbuf, rbuf);
 	// Moves
 	sprintf(lbuf, "Moves: %d", moves);
 	sprintf(rbuf, "Moves: -");
-	setColor(GREY);
-	printf("%-20s %20s\n", lbuf, rbuf);
+	fb_color(GREY);
+	fb_printf("%-20s %20s\n", lbuf, rbuf);
 	// Coins
 	sprintf(lbuf, "Coins: %d", coins);
 	if (ae != -1) sprintf(rbuf, "Coins: %d", enemies[ae].coins_drop); else sprintf(rbuf, "Coins: 0");
-	setColor(YELLOW);	
-	printf("%-20s %20s\n", lbuf, rbuf);
+	fb_color(YELLOW);
+	fb_printf("%-20s %20s\n", lbuf, rbuf);
 	// Torch
 	sprintf(lbuf, "Torch: %d", torch);
 	if (ae != -1) sprintf(rbuf, "Torch: %d", enemies[ae].torch_drop); else sprintf(rbuf, "Torch: 0");
-	setColor(LIGHTRED);
-	printf("%-20s %20s\n", lbuf, rbuf);
+	fb_color(LIGHTRED);
+	fb_printf("%-20s %20s\n", lbuf, rbuf);
 	// Potions
 	sprintf(lbuf, "Potions: %d", potions);
 	if (ae != -1) sprintf(rbuf, "Potions: %d", enemies[ae].potions_drop); else sprintf(rbuf, "Potions: 0");
-	setColor(MAGENTA);	
-	printf("%-20s %20s\n", lbuf, rbuf);
+	fb_color(MAGENTA);
+	fb_printf("%-20s %20s\n", lbuf, rbuf);
 	// Kills
 	sprintf(lbuf, "Kills: %d", kills);
-	sprintf(rbuf, "");
-	setColor(BLUE);
-	printf("%-20s %20s\n", lbuf, rbuf);
-	setColor(WHITE);
+	rbuf[0] = 0;
+	fb_color(BLUE);
+	fb_printf("%-20s %20s\n", lbuf, rbuf);
+	fb_color(WHITE);
 
 	// Message log (max 14 lines), newest messages on top
-	locate(MAPSIZE + 5, 1);
-	setColor(GREY);
-	printf("~~~Message Log:~~~");
-	for (size_t m = 0; m < 14; m++) {
-		locate(MAPSIZE + 5, 2 + (int)m);
-		if (m < msglog.size()) {
-			//setColor(WHITE);
-			printf("%-80s", msglog[m].c_str());
-		} else {
-			printf("%-80s", "");
+	if (!caps->tty) {
+		// plain output: just append what is new, oldest first
+		unsigned long fresh = msg_count - msg_drawn;
+		for (int m = (int)min(fresh, (unsigned long)msglog.size()) - 1; m >= 0; m--) {
+			frame += msglog[m];
+			frame += '\n';
+		}
+	} else if (!term_alt || full_redraw) {
+		fb_locate(map_w + 5, 1);
+		fb_color(GREY);
+		frame += "~~~Message Log:~~~";
+		for (size_t m = 0; m < MSGLOG_LINES; m++) {
+			fb_locate(map_w + 5, 2 + (int)m);
+			if (m < msglog.size()) {
+				//fb_color(WHITE);
+				fb_printf("%-80s", msglog[m]);
+			} else {
+				fb_printf("%-80s", "");
+			}
+			frame += '\n';
 		}
-		printf("\n");
 	}
+	if (term_sync) frame += ANSI_SYNC_END;
+}
+
+void spectate_publish();
+bool spectating = false;
+
+void draw() {
+	compose_frame();
+	if (spectating) spectate_publish();
+	fb_flush();
+	full_redraw = false;
+	msg_drawn = msg_count;
 }
 
 // Show help screen and wait for any key to return
@@ -414,13 +2366,19 @@ void show_help() {
 	printf("Attack: WASD\n");
 	printf("Use potion: p\n");
 	printf("Defend: e\n");
+	printf("Set down a torch: t\n");
+	printf("Climb the stairs up: < (standing on <)\n");
+	printf("Travel to stairs down: >\n");
+	printf("Auto-explore: o\n");
+	printf("Undo last turn: u\n");
 	printf("Help: h\n");
 	printf("Quit: ESC\n\n");
 	printf("Symbols:\n");
 	setColor(BLUE); printf(" . "); setColor(WHITE); printf("= floor\n");
 	setColor(CYAN); printf(" # "); setColor(WHITE); printf("= wall\n");
 	setColor(YELLOW); printf(" o "); setColor(WHITE); printf("= coin\n");
-	setColor(GREEN); printf(" < "); setColor(WHITE); printf("= stairs down\n");
+	setColor(GREEN); printf(" > "); setColor(WHITE); printf("= stairs down\n");
+	setColor(LIGHTGREEN); printf(" < "); setColor(WHITE); printf("= stairs up (back to the level above)\n");
 	setColor(LIGHTRED); printf(" f "); setColor(WHITE); printf("= torch\n");
 	setColor(MAGENTA); printf(" P "); setColor(WHITE); printf("= potion\n");
 	setColor(LIGHTCYAN); printf(" S "); setColor(WHITE); printf("= sword (increases attack)\n");
@@ -515,82 +2473,1611 @@ R"(=============================================================================
 	anykey("\nHit any key to continue...\n");
 }
 
-/// Main loop and input handling
-int main() {
-	hidecursor();
-	saveDefaultColor();
+/// Spectators
+// --spectate=PORT streams the game to any number of viewers on 127.0.0.1:PORT
+// (nc 127.0.0.1 PORT in a terminal the game's size). draw() encodes a frame
+// once into an immutable refcounted SpecFrame; every viewer queue points at
+// the same one and a broadcaster thread sends each queue with one writev, so
+// formatting cost does not grow with the audience. Frames are diffs against
+// the previous one. A viewer more than SPEC_QUEUE frames behind loses its
+// unsent frames and waits for a keyframe (a full repaint, composed once per
+// frame for everyone who needs one) instead of queueing without bound.
+#ifndef _WIN32
+#define SPEC_QUEUE 8      // frames a viewer may lag before it is resynced
+#define SPEC_MAX_IOV 32   // frames per writev
+
+struct SpecFrame {
+	std::atomic<int> refs;
+	size_t len;
+	char data[1];
+};
+
+SpecFrame *spec_frame(const std::string &bytes) {
+	SpecFrame *f = (SpecFrame *)malloc(sizeof(SpecFrame) + bytes.size());
+	new (&f->refs) std::atomic<int>(1);
+	f->len = bytes.size();
+	memcpy(f->data, bytes.data(), bytes.size());
+	return f;
+}
+SpecFrame *spec_ref(SpecFrame *f) { if (f) f->refs++; return f; }
+void spec_unref(SpecFrame *f) { if (f && --f->refs == 0) free(f); }
+
+struct Viewer {
+	int fd;
+	std::deque<SpecFrame *> q;
+	size_t off = 0;        // bytes of q.front() already sent
+	bool need_key = true;
+};
+
+// A drawn frame and, when some viewer asked for one, its keyframe
+struct SpecPublish { SpecFrame *diff, *key; };
+
+int spec_listen = -1, spec_wake[2] = { -1, -1 };
+std::thread spec_thread;
+std::atomic<bool> spec_running{false};
+std::atomic<bool> spec_need_key{false}; // broadcaster wants a keyframe with the next frame
+std::mutex spec_lock;
+std::vector<SpecPublish> spec_pending;  // guarded by spec_lock
+std::vector<Viewer> viewers;            // broadcaster thread only
+long long spec_frames = 0, spec_keyframes = 0, spec_dropped = 0, spec_viewers_total = 0;
+std::string spec_key_buf;
+
+// Game thread: hand the frame just composed to the broadcaster
+void spectate_publish() {
+	SpecPublish p;
+	p.diff = spec_frame(frame);
+	p.key = NULL;
+	if (spec_need_key.exchange(false)) {
+		// repaint everything from an unknown color into a side buffer
+		bool fr = full_redraw;
+		full_redraw = true;
+		caps->cur_color = -1;
+		frame.swap(spec_key_buf);
+		frame.clear();
+		compose_frame();
+		frame.swap(spec_key_buf);
+		full_redraw = fr;
+		p.key = spec_frame(spec_key_buf);
+		caps->cur_color = -1; // terminals now disagree; the next frame sets its color
+		spec_keyframes++;
+	}
+	spec_frames++;
+	{
+		std::lock_guard<std::mutex> g(spec_lock);
+		spec_pending.push_back(p);
+	}
+	char b = 1;
+	if (write(spec_wake[1], &b, 1) < 0) {}
+}
+
+void viewer_close(Viewer &v) {
+	close(v.fd);
+	for (size_t i = 0; i < v.q.size(); i++) spec_unref(v.q[i]);
+	v.q.clear();
+	v.fd = -1;
+}
+
+// Queue a published frame for one viewer, resyncing it if it lags
+void viewer_offer(Viewer &v, const SpecPublish &p) {
+	if (v.need_key) {
+		if (!p.key) return;
+		v.q.push_back(spec_ref(p.key));
+		v.need_key = false;
+		return;
+	}
+	if (v.q.size() >= SPEC_QUEUE) {
+		// keep only a frame that is partly on the wire, then wait for a keyframe
+		size_t keep = v.off ? 1 : 0;
+		spec_dropped += v.q.size() - keep;
+		while (v.q.size() > keep) { spec_unref(v.q.back()); v.q.pop_back(); }
+		v.need_key = true;
+		if (v.q.empty()) spec_need_key = true; // otherwise asked for once the socket drains
+		return;
+	}
+	v.q.push_back(spec_ref(p.diff));
+}
+
+// Send as much of the viewer's queue as the socket takes
+void viewer_send(Viewer &v) {
+	while (!v.q.empty()) {
+		struct iovec iov[SPEC_MAX_IOV];
+		int n = 0;
+		for (size_t i = 0; i < v.q.size() && n < SPEC_MAX_IOV; i++, n++) {
+			size_t skip = i == 0 ? v.off : 0;
+			iov[n].iov_base = v.q[i]->data + skip;
+			iov[n].iov_len = v.q[i]->len - skip;
+		}
+		ssize_t w = writev(v.fd, iov, n);
+		if (w < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) viewer_close(v);
+			return;
+		}
+		size_t left = (size_t)w;
+		while (!v.q.empty() && left >= v.q.front()->len - v.off) {
+			left -= v.q.front()->len - v.off;
+			spec_unref(v.q.front());
+			v.q.pop_front();
+			v.off = 0;
+		}
+		v.off += left;
+		if (left) return; // socket full
+	}
+	if (v.need_key) spec_need_key = true;
+}
+
+void spectate_loop() {
+	std::vector<struct pollfd> pfd;
+	std::vector<SpecPublish> batch;
+	while (spec_running) {
+		pfd.clear();
+		pfd.push_back({ spec_wake[0], POLLIN, 0 });
+		pfd.push_back({ spec_listen, POLLIN, 0 });
+		for (size_t i = 0; i < viewers.size(); i++)
+			pfd.push_back({ viewers[i].fd, (short)(POLLIN | (viewers[i].q.empty() ? 0 : POLLOUT)), 0 });
+		if (poll(pfd.data(), pfd.size(), -1) < 0) continue;
+
+		// viewers first: pfd indexes match before anything is added
+		for (size_t i = 0; i < viewers.size(); i++) {
+			short re = pfd[2 + i].revents;
+			if (re & (POLLIN | POLLHUP | POLLERR)) {
+				char buf[256];
+				ssize_t r = read(viewers[i].fd, buf, sizeof(buf)); // viewers' keys are ignored
+				if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) { viewer_close(viewers[i]); continue; }
+			}
+			if (re & POLLOUT) viewer_send(viewers[i]);
+		}
+		if (pfd[1].revents & POLLIN) {
+			int fd;
+			while ((fd = accept(spec_listen, NULL, NULL)) >= 0) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				Viewer v;
+				v.fd = fd;
+				viewers.push_back(v);
+				spec_viewers_total++;
+				spec_need_key = true;
+			}
+		}
+		if (pfd[0].revents & POLLIN) {
+			char buf[256];
+			while (read(spec_wake[0], buf, sizeof(buf)) > 0) {}
+			{
+				std::lock_guard<std::mutex> g(spec_lock);
+				batch.swap(spec_pending);
+			}
+			for (size_t b = 0; b < batch.size(); b++) {
+				for (size_t i = 0; i < viewers.size(); i++)
+					if (viewers[i].fd >= 0) viewer_offer(viewers[i], batch[b]);
+				spec_unref(batch[b].diff);
+				spec_unref(batch[b].key);
+			}
+			batch.clear();
+			for (size_t i = 0; i < viewers.size(); i++)
+				if (viewers[i].fd >= 0) viewer_send(viewers[i]);
+		}
+		viewers.erase(std::remove_if(viewers.begin(), viewers.end(), [](const Viewer &v) { return v.fd < 0; }), viewers.end());
+	}
+}
+
+bool spectate_start() {
+	spec_listen = socket(AF_INET, SOCK_STREAM, 0);
+	if (spec_listen < 0) { perror("spectate"); return false; }
+	int one = 1;
+	setsockopt(spec_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in a;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons((uint16_t)opt_spectate_port);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(spec_listen, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(spec_listen, 128) < 0) { perror("spectate"); return false; }
+	if (pipe(spec_wake) < 0) { perror("spectate"); return false; }
+	fcntl(spec_listen, F_SETFL, fcntl(spec_listen, F_GETFL) | O_NONBLOCK);
+	fcntl(spec_wake[0], F_SETFL, fcntl(spec_wake[0], F_GETFL) | O_NONBLOCK);
+	signal(SIGPIPE, SIG_IGN); // a viewer hanging up is an EPIPE, not a signal
+	spec_running = true;
+	spec_thread = std::thread(spectate_loop);
+	spectating = true;
+	return true;
+}
+
+void spectate_finish() {
+	if (!spectating) return;
+	spectating = false;
+	spec_running = false;
+	char b = 0;
+	if (write(spec_wake[1], &b, 1) < 0) {}
+	spec_thread.join();
+	for (size_t i = 0; i < viewers.size(); i++) if (viewers[i].fd >= 0) viewer_close(viewers[i]);
+	for (size_t b = 0; b < spec_pending.size(); b++) { spec_unref(spec_pending[b].diff); spec_unref(spec_pending[b].key); }
+	spec_pending.clear();
+	close(spec_listen); close(spec_wake[0]); close(spec_wake[1]);
+}
+#else
+long long spec_frames = 0, spec_keyframes = 0, spec_dropped = 0, spec_viewers_total = 0;
+std::atomic<bool> spec_need_key{false};
+void spectate_publish() {}
+bool spectate_start() { fprintf(stderr, "--spectate needs POSIX sockets\n"); return false; }
+void spectate_finish() {}
+#endif
+
+/// Options
+// Command line flags: --name or --name=value
+bool parse_int_opt(const char *arg, const char *name, int *out) {
+	size_t n = strlen(name);
+	if (strncmp(arg, name, n) != 0 || arg[n] != '=') return false;
+	*out = atoi(arg + n + 1);
+	return true;
+}
+
+bool parse_args(int argc, char **argv) {
+	for (int a = 1; a < argc; a++) {
+		const char *arg = argv[a];
+		if (strcmp(arg, "--realtime") == 0) opt_realtime = true;
+		else if (parse_int_opt(arg, "--tick-hz", &opt_tick_hz)) {}
+		else if (parse_int_opt(arg, "--turn-ticks", &opt_turn_ticks)) {}
+		else if (parse_int_opt(arg, "--fps", &opt_fps)) {}
+		else if (parse_int_opt(arg, "--min-fps", &opt_min_fps)) {}
+		else if (parse_int_opt(arg, "--enemies", &opt_enemies)) {}
+		else if (parse_int_opt(arg, "--bench-gen", &opt_bench_gen)) {}
+		else if (strncmp(arg, "--seed=", 7) == 0) { run_seed = strtoull(arg + 7, NULL, 10); opt_seed_given = true; }
+		else if (strncmp(arg, "--history=", 10) == 0) opt_history_path = arg + 10;
+		else if (strcmp(arg, "--no-history") == 0) opt_history = false;
+		else if (strcmp(arg, "--scores") == 0) opt_scores = 10;
+		else if (parse_int_opt(arg, "--scores", &opt_scores)) {}
+		else if (strncmp(arg, "--telemetry=", 12) == 0) opt_telemetry_path = arg + 12;
+		else if (strcmp(arg, "--telemetry-format=json") == 0) opt_telemetry_json = true;
+		else if (strcmp(arg, "--telemetry-format=bin") == 0) opt_telemetry_json = false;
+		else if (strncmp(arg, "--mapsize=", 10) == 0) {
+			// N or WxH
+			if (sscanf(arg + 10, "%dx%d", &map_w, &map_h) < 2) map_h = map_w;
+		}
+		else if (strcmp(arg, "--dynamic-map") == 0) opt_dynamic_dims = true;
+		else if (strncmp(arg, "--simulate=", 11) == 0) opt_simulate = atoll(arg + 11);
+		else if (parse_int_opt(arg, "--threads", &opt_threads)) {}
+		else if (parse_int_opt(arg, "--sim-levels", &opt_sim_levels)) {}
+		else if (strncmp(arg, "--csv=", 6) == 0) opt_csv_path = arg + 6;
+		else if (strcmp(arg, "--no-intro") == 0) opt_no_intro = true;
+		else if (strcmp(arg, "--perf") == 0) opt_perf = true;
+		else if (strcmp(arg, "--gen=cave") == 0) opt_gen = GEN_CAVE;
+		else if (strcmp(arg, "--gen=bsp") == 0) opt_gen = GEN_BSP;
+		else if (strcmp(arg, "--gen=mixed") == 0) opt_gen = GEN_MIXED;
+		else if (strncmp(arg, "--pack=", 7) == 0) opt_pack_path = arg + 7;
+		else if (strncmp(arg, "--build-pack=", 13) == 0) opt_build_pack = arg + 13;
+		else if (parse_int_opt(arg, "--pack-levels", &opt_pack_levels)) {}
+		else if (parse_int_opt(arg, "--undo-depth", &opt_undo_depth)) {}
+		else if (parse_int_opt(arg, "--level-store", &opt_level_store_kb)) {}
+		else if (parse_int_opt(arg, "--spectate", &opt_spectate_port)) {}
+		else if (parse_int_opt(arg, "--bench-batch", &opt_bench_batch)) {}
+		else if (parse_int_opt(arg, "--bench-latency", &opt_bench_latency)) {}
+		else if (strncmp(arg, "--latency-keys=", 15) == 0 && arg[15]) opt_latency_keys = arg + 15;
+		else {
+			fprintf(stderr, "unknown option: %s\n", arg);
+			fprintf(stderr, "usage: %s [--realtime] [--tick-hz=N] [--turn-ticks=N] [--fps=N] [--min-fps=N] [--enemies=N] [--bench-gen=N]\n"
+				"       [--seed=N] [--history=PREFIX] [--no-history] [--scores[=N]]\n"
+				"       [--telemetry=PATH] [--telemetry-format=bin|json] [--mapsize=N|WxH] [--dynamic-map]\n"
+				"       [--simulate=N] [--threads=N] [--sim-levels=N] [--csv=PATH]\n"
+				"       [--no-intro] [--bench-latency=N] [--latency-keys=KEYS] [--perf]\n"
+				"       [--gen=cave|bsp|mixed] [--pack=PATH] [--build-pack=PATH] [--pack-levels=N]\n"
+				"       [--undo-depth=N] [--spectate=PORT] [--bench-batch=K] [--level-store=KB]\n", argv[0]);
+			return false;
+		}
+	}
+	if (opt_tick_hz < 1) opt_tick_hz = 1;
+	if (opt_turn_ticks < 1) opt_turn_ticks = 1;
+	if (opt_fps < 1) opt_fps = 1;
+	if (opt_min_fps < 1) opt_min_fps = 1;
+	if (opt_sim_levels < 1) opt_sim_levels = 1;
+	if (opt_undo_depth < 0) opt_undo_depth = 0;
+	if (opt_level_store_kb < 0) opt_level_store_kb = opt_simulate > 0 || opt_bench_batch > 0 ? 0 : 1024;
+	if (map_w < 5 || map_h < 5 || map_w > MAP_MAX || map_h > MAP_MAX) {
+		fprintf(stderr, "--mapsize must be between 5 and %d\n", MAP_MAX);
+		return false;
+	}
+	return true;
+}
+
+/// Timing
+// Monotonic nanoseconds, paired with sleep_until_ns() for frame pacing
+long long now_ns() {
+#ifdef _WIN32
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+// Sleep until the absolute monotonic time t, without drift from loop overhead
+void sleep_until_ns(long long t) {
+#ifdef _WIN32
+	long long left = t - now_ns();
+	if (left > 0) Sleep((DWORD)(left / 1000000));
+#else
+	struct timespec ts;
+	ts.tv_sec = t / 1000000000LL;
+	ts.tv_nsec = t % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+#endif
+}
+
+// Accumulates durations of one loop phase
+struct PhaseTimer {
+	long long count = 0;
+	long long total_ns = 0;
+	long long max_ns = 0;
+	void add(long long ns) { count++; total_ns += ns; if (ns > max_ns) max_ns = ns; }
+	double avg_us() const { return count ? total_ns / 1000.0 / count : 0.0; }
+};
+
+// Real-time loop statistics, reported in the summary
+PhaseTimer rt_tick, rt_render;
+long long rt_late_ticks = 0; // ticks dropped because the loop fell behind
+long long rt_elapsed_ns = 0;
+
+// Turn-based rendering: frames shown, and turns whose frame was skipped
+// because more input was already waiting
+long long frames_drawn = 0, frames_coalesced = 0;
+
+/// Run history
+// Append-only log of finished runs (<prefix>.runs, fixed 64-byte records) and
+// two on-disk indexes over it: by score (<prefix>.score.idx) and by seed then
+// score (<prefix>.seed.idx). An index is a short list of sorted runs of fixed
+// size entries. A new batch is appended as a run and merged into the one
+// before it while that one is at most twice its size, which keeps O(log n)
+// runs; every lookup is a binary search per run. No server, just three files:
+// games sharing them flock the run log, exclusively to append a run and index
+// it, shared to read, so nobody sees an index halfway through a merge.
+struct RunRecord {
+	uint64_t seed;
+	int64_t score;
+	int64_t time;          // unix seconds
+	int32_t level, kills, coins, moves;
+	int32_t sword, hp, potions_used, potions;
+	int32_t achievements;  // achievement points
+	int32_t end_code;      // EndCode
+};
+static_assert(sizeof(RunRecord) == 64, "run records are fixed 64-byte slots");
+
+// Score index entry: score key, record number
+struct IndexEntry {
+	static const uint32_t version = 1;
+	uint64_t hi, lo;
+	bool operator<(const IndexEntry &o) const { return hi != o.hi ? hi < o.hi : lo < o.lo; }
+};
+
+// Seed index entry: best score first within a seed
+struct SeedEntry {
+	static const uint32_t version = 2; // 1 packed a 32-bit score and record number into one word
+	uint64_t seed, key, id;
+	bool operator<(const SeedEntry &o) const {
+		return seed != o.seed ? seed < o.seed : key != o.key ? key < o.key : id < o.id;
+	}
+};
+
+// Ascending keys give descending scores
+uint64_t score_key(int64_t score) { return ~((uint64_t)score ^ 0x8000000000000000ULL); }
+int64_t key_score(uint64_t key) { return (int64_t)(~key ^ 0x8000000000000000ULL); }
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+#define IDX_MAGIC 0x58444952u // "RIDX"
+#define IDX_MAX_RUNS 64
+
+template <class E> struct SortedRunIndex {
+	struct Header {
+		uint32_t magic, version, nruns, pad;
+		struct { uint64_t offset, count; } run[IDX_MAX_RUNS]; // in entries
+	} h;
+	FILE *f = NULL;
+
+	~SortedRunIndex() { if (f) fclose(f); }
+
+	// An index in an older format is emptied when stale is given, else refused
+	bool open(const std::string &path, bool *stale = NULL) {
+		f = fopen(path.c_str(), "r+b");
+		if (!f) f = fopen(path.c_str(), "w+b");
+		if (!f) return false;
+		if (fread(&h, sizeof(h), 1, f) == 1 && h.magic == IDX_MAGIC && h.version != E::version && stale) {
+			*stale = true;
+			f = freopen(path.c_str(), "w+b", f);
+			if (!f) return false;
+		} else if (stale) *stale = false;
+		if (fseek64(f, 0, SEEK_SET) != 0 || fread(&h, sizeof(h), 1, f) != 1) {
+			memset(&h, 0, sizeof(h));
+			h.magic = IDX_MAGIC; h.version = E::version;
+			return write_header();
+		}
+		return h.magic == IDX_MAGIC && h.version == E::version && h.nruns <= IDX_MAX_RUNS;
+	}
+
+	uint64_t size() const {
+		uint64_t n = 0;
+		for (uint32_t r = 0; r < h.nruns; r++) n += h.run[r].count;
+		return n;
+	}
+
+	bool write_header() {
+		return fseek64(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+	}
+
+	bool read_entries(uint64_t at, E *e, size_t n) {
+		return fseek64(f, sizeof(h) + at * sizeof(E), SEEK_SET) == 0 && fread(e, sizeof(E), n, f) == n;
+	}
+
+	bool write_entries(uint64_t at, const E *e, size_t n) {
+		return fseek64(f, sizeof(h) + at * sizeof(E), SEEK_SET) == 0 && fwrite(e, sizeof(E), n, f) == n;
+	}
+
+	// Position in run r of the first entry not less than k
+	uint64_t lower_bound(uint32_t r, const E &k) {
+		uint64_t lo = 0, hi = h.run[r].count;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			E e;
+			if (!read_entries(h.run[r].offset + mid, &e, 1)) return hi;
+			if (e < k) lo = mid + 1; else hi = mid;
+		}
+		return lo;
+	}
+
+	// Number of entries ordered before k
+	uint64_t count_below(const E &k) {
+		uint64_t n = 0;
+		for (uint32_t r = 0; r < h.nruns; r++) n += lower_bound(r, k);
+		return n;
+	}
+
+	// Smallest entry not less than k
+	bool first_at_least(const E &k, E *out) {
+		bool found = false;
+		for (uint32_t r = 0; r < h.nruns; r++) {
+			uint64_t pos = lower_bound(r, k);
+			E e;
+			if (pos < h.run[r].count && read_entries(h.run[r].offset + pos, &e, 1) && (!found || e < *out)) {
+				*out = e;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	// The n smallest entries overall: the first n of every run, merged
+	void smallest(size_t n, std::vector<E> &out) {
+		out.clear();
+		for (uint32_t r = 0; r < h.nruns; r++) {
+			size_t take = (size_t)std::min<uint64_t>(n, h.run[r].count);
+			size_t at = out.size();
+			out.resize(at + take);
+			if (!read_entries(h.run[r].offset, out.data() + at, take)) out.resize(at);
+		}
+		std::sort(out.begin(), out.end());
+		if (out.size() > n) out.resize(n);
+	}
+
+	// Append a batch as a new run, then merge tail runs back into shape
+	bool insert(std::vector<E> &batch) {
+		if (batch.empty()) return true;
+		std::sort(batch.begin(), batch.end());
+		uint64_t end = size();
+		if (!write_entries(end, batch.data(), batch.size())) return false;
+		h.run[h.nruns].offset = end;
+		h.run[h.nruns].count = batch.size();
+		h.nruns++;
+		while (h.nruns >= 2 && (h.run[h.nruns-2].count <= 2 * h.run[h.nruns-1].count || h.nruns == IDX_MAX_RUNS)) {
+			uint64_t off = h.run[h.nruns-2].offset;
+			uint64_t a = h.run[h.nruns-2].count, b = h.run[h.nruns-1].count;
+			std::vector<E> tail(a + b), merged(a + b);
+			if (!read_entries(off, tail.data(), tail.size())) return false;
+			std::merge(tail.begin(), tail.begin() + a, tail.begin() + a, tail.end(), merged.begin());
+			if (!write_entries(off, merged.data(), merged.size())) return false;
+			h.nruns--;
+			h.run[h.nruns-1].count = a + b;
+		}
+		return write_header() && fflush(f) == 0;
+	}
+};
+
+// The run log, locked until it is closed
+FILE *history_open(const char *mode, bool exclusive) {
+	FILE *f = fopen((opt_history_path + ".runs").c_str(), mode);
+#ifndef _WIN32
+	if (f) flock(fileno(f), exclusive ? LOCK_EX : LOCK_SH);
+#else
+	(void)exclusive;
+#endif
+	return f;
+}
+
+bool history_read(FILE *f, uint64_t id, RunRecord *r) {
+	return fseek64(f, id * sizeof(RunRecord), SEEK_SET) == 0 && fread(r, sizeof(RunRecord), 1, f) == 1;
+}
+
+// Append finished runs and index them; *first_id gets the first record number
+bool history_append(const RunRecord *recs, size_t n, uint64_t *first_id) {
+	std::string base = opt_history_path;
+	FILE *f = history_open("a+b", true);
+	if (!f) return false;
+	fseek64(f, 0, SEEK_END);
+	uint64_t id0 = (uint64_t)ftell64(f) / sizeof(RunRecord);
+	bool ok = fwrite(recs, sizeof(RunRecord), n, f) == n && fflush(f) == 0;
+
+	std::vector<IndexEntry> by_score(n);
+	for (size_t i = 0; i < n; i++) {
+		by_score[i].hi = score_key(recs[i].score);
+		by_score[i].lo = id0 + i;
+	}
+	SortedRunIndex<IndexEntry> score_idx;
+	ok = ok && score_idx.open(base + ".score.idx") && score_idx.insert(by_score);
+
+	// a seed index in the old format is rebuilt from the whole log
+	SortedRunIndex<SeedEntry> seed_idx;
+	bool stale = false;
+	ok = ok && seed_idx.open(base + ".seed.idx", &stale);
+	uint64_t from = stale ? 0 : id0;
+	std::vector<SeedEntry> by_seed;
+	RunRecord r;
+	for (uint64_t id = from; ok && id < id0 + n; id++) {
+		if (id >= id0) r = recs[id - id0];
+		else if (!history_read(f, id, &r)) { ok = false; break; }
+		SeedEntry e = { r.seed, score_key(r.score), id };
+		by_seed.push_back(e);
+	}
+	ok = ok && seed_idx.insert(by_seed);
+	fclose(f);
+	if (ok && first_id) *first_id = id0;
+	return ok;
+}
+
+// Leaderboard and where a score stands among all recorded runs
+struct HistoryStanding {
+	uint64_t total;        // recorded runs
+	uint64_t better;       // runs with a strictly higher score
+	bool has_seed_best;
+	RunRecord seed_best;   // best run for the queried seed
+	std::vector<RunRecord> top;
+};
+
+bool history_query(int64_t score, uint64_t seed, size_t top_n, HistoryStanding *st) {
+	FILE *f = history_open("rb", false);
+	if (!f) return false;
+	SortedRunIndex<IndexEntry> score_idx;
+	SortedRunIndex<SeedEntry> seed_idx;
+	if (!score_idx.open(opt_history_path + ".score.idx")) { fclose(f); return false; }
+	st->total = score_idx.size();
+	IndexEntry k = { score_key(score), 0 };
+	st->better = score_idx.count_below(k);
+	std::vector<IndexEntry> top;
+	score_idx.smallest(top_n, top);
+	st->top.clear();
+	for (size_t i = 0; i < top.size(); i++) {
+		RunRecord r;
+		if (history_read(f, top[i].lo, &r)) st->top.push_back(r);
+	}
+	SeedEntry sk = { seed, 0, 0 }, best = { 0, 0, 0 };
+	st->has_seed_best = seed_idx.open(opt_history_path + ".seed.idx") && seed_idx.first_at_least(sk, &best)
+		&& best.seed == seed && history_read(f, best.id, &st->seed_best);
+	fclose(f);
+	return true;
+}
+
+// Score at 0-based rank r (0 = best): binary search on the key space
+bool history_score_at_rank(SortedRunIndex<IndexEntry> &score_idx, uint64_t r, int64_t *score) {
+	if (r >= score_idx.size()) return false;
+	uint64_t lo = 0, hi = UINT64_MAX;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		IndexEntry k = { mid + 1, 0 };
+		if (score_idx.count_below(k) > r) hi = mid; else lo = mid + 1;
+	}
+	*score = key_score(lo);
+	return true;
+}
+
+const char *end_code_name(int code) {
+	switch (code) {
+		case END_TORCH: return "torch out";
+		case END_KILLED: return "killed";
+		default: return "quit";
+	}
+}
+
+void print_run_line(int rank, const RunRecord &r) {
+	printf(" %3d. %8lld  level %-3d kills %-4d coins %-4d seed %llu (%s)\n", rank, (long long)r.score,
+		r.level, r.kills, r.coins, (unsigned long long)r.seed, end_code_name(r.end_code));
+}
+
+// --scores: leaderboard and score percentiles, then exit
+void print_scores(int n) {
+	HistoryStanding st;
+	if (!history_query(0, run_seed, n, &st) || st.total == 0) { printf("No runs recorded in %s.runs\n", opt_history_path.c_str()); return; }
+	printf("Top %d of %llu runs:\n", (int)st.top.size(), (unsigned long long)st.total);
+	for (size_t i = 0; i < st.top.size(); i++) print_run_line((int)i + 1, st.top[i]);
+	FILE *f = history_open("rb", false);
+	SortedRunIndex<IndexEntry> score_idx;
+	if (f && score_idx.open(opt_history_path + ".score.idx")) {
+		const int pct[] = {50, 90, 99};
+		printf("Percentiles:");
+		for (int p : pct) {
+			int64_t sc;
+			uint64_t rank = st.total - 1 - (st.total - 1) * p / 100;
+			if (history_score_at_rank(score_idx, rank, &sc)) printf("  p%d %lld", p, (long long)sc);
+		}
+		printf("\n");
+	}
+	if (f) fclose(f);
+	if (opt_seed_given) {
+		if (st.has_seed_best) { printf("Best for seed %llu:\n", (unsigned long long)run_seed); print_run_line(1, st.seed_best); }
+		else printf("No runs for seed %llu.\n", (unsigned long long)run_seed);
+	}
+}
+
+/// Benchmarks
+// --bench-gen: generate levels back to back (levels 1..50 cycling) and report
+// time per level plus heap traffic once the level arena has warmed up, then
+// run the same levels through the DynamicDims code for comparison
+double bench_gen_pass(int n, int warmup, long long *heap, long long *spills) {
+	long long t0 = 0, heap0 = 0, spills0 = 0;
+	for (int i = 0; i < n; i++) {
+		if (i == warmup) { t0 = now_ns(); heap0 = heap_allocs.load(); spills0 = level_arena->spills(); }
+		level = 1 + i % 50;
+		gen(level);
+	}
+	long long ns = now_ns() - t0;
+	*heap = heap_allocs.load() - heap0;
+	*spills = level_arena->spills() - spills0;
+	return n > warmup ? ns / 1000.0 / (n - warmup) : 0.0;
+}
+
+// Enemy turns on a freshly generated level with every enemy awake
+double bench_turns_pass(int n, size_t *awake) {
+	level = 25;
 	gen(level);
+	for (size_t e = 0; e < enemies.size(); e++) enemies[e].active = true;
+	*awake = enemies.size();
+	int hp0 = hp;
+	long long t0 = now_ns();
+	for (int i = 0; i < n; i++) {
+		process_enemies_turn();
+		hp = hp0;
+	}
+	return n ? (now_ns() - t0) / 1000.0 / n : 0.0;
+}
 
-	show_begining();
+// Frames composed into the frame buffer and discarded
+double bench_draw_pass(int n) {
+	level = 25;
+	gen(level);
+	long long t0 = now_ns();
+	for (int i = 0; i < n; i++) {
+		compose_frame();
+		frame.clear();
+	}
+	return n ? (now_ns() - t0) / 1000.0 / n : 0.0;
+}
 
-	push_msg("Game started.");
-	draw();
-	bool running = true;
+// Time per generator stage, every engine on the same level numbers
+void bench_stages(int n) {
+	int saved = opt_gen;
+	gen_timing = true;
+	printf("stages (us/level)  %8s %8s %8s %8s %8s\n", gen_stage_names[0], gen_stage_names[1], gen_stage_names[2], gen_stage_names[3], "total");
+	for (int k = 0; k < GEN_KINDS; k++) {
+		opt_gen = k;
+		memset(gen_stage_ns[k], 0, sizeof(gen_stage_ns[k]));
+		for (int i = 0; i < n; i++) {
+			level = 1 + i % 50;
+			gen(level);
+		}
+		long long total = 0;
+		printf("  %-16s", gen_names[k]);
+		for (int st = 0; st < GS_COUNT; st++) {
+			printf(" %8.2f", gen_stage_ns[k][st] / 1000.0 / n);
+			total += gen_stage_ns[k][st];
+		}
+		printf(" %8.2f\n", total / 1000.0 / n);
+	}
+	gen_timing = false;
+	opt_gen = saved;
+}
+
+// Leave n generated levels into the level store and come back to each;
+// us per leave and per re-entry, stored and uncompressed bytes per level
+void bench_store_pass(int n, double *leave_us, double *enter_us, double *bytes, double *raw) {
+	store_clear();
+	long long leave = 0, enter = 0;
+	size_t raw_total = 0;
+	for (int lv = 1; lv <= n; lv++) {
+		level = lv;
+		gen(lv);
+		raw_total += (size_t)(map_w + 2) * map_stride + 1 + enemies.size() * sizeof(Enemy);
+		long long t0 = now_ns();
+		with_dims([lv](auto d) { store_level<decltype(d)>(lv); });
+		leave += now_ns() - t0;
+	}
+	*bytes = level_store.empty() ? 0.0 : (double)level_store_bytes / level_store.size();
+	*raw = n ? (double)raw_total / n : 0.0;
+	int back = 0;
+	for (int lv = n; lv >= 1; lv--) {
+		bool hit = false;
+		long long t0 = now_ns();
+		with_dims([lv, &hit](auto d) { hit = store_load<decltype(d)>(lv, false); });
+		if (hit) { enter += now_ns() - t0; back++; }
+	}
+	store_clear();
+	*leave_us = n ? leave / 1000.0 / n : 0.0;
+	*enter_us = back ? enter / 1000.0 / back : 0.0;
+}
+
+// Cost of one bounded draw, refills included.
+double bench_rng_pass() {
+	RngStream s;
+	seed_stream(s, 1);
+	const int draws = 1 << 22;
+	unsigned sink = 0;
+	long long t0 = now_ns();
+	for (int i = 0; i < draws; i++) sink += rnd(s, 100);
+	long long t1 = now_ns();
+	volatile unsigned keep = sink; (void)keep;
+	return (double)(t1 - t0) / draws;
+}
+
+void bench_gen(int n) {
+	int warmup = min(100, n / 2);
+	int measured = n - warmup;
+	long long heap, spills;
+	size_t awake;
+	bool forced = opt_dynamic_dims;
+	double turn_us = bench_turns_pass(n, &awake);
+	double us = bench_gen_pass(n, warmup, &heap, &spills);
+	double draw_us = bench_draw_pass(n);
+	printf("map %dx%d (%s)\n", map_w, map_h, forced ? "dynamic" : "specialized if available");
+	printf("gen: %d levels (+%d warm-up), %.2f us/level\n", measured, warmup, us);
+	printf("arena: first block %zu bytes, last level used %zu, spills after warm-up %lld\n",
+		level_arena->block_size(), level_arena->bytes_used(), spills);
+#ifdef GAME_HEAP_STATS
+	printf("heap allocations after warm-up: %lld (%.3f per level)\n", heap, measured ? (double)heap / measured : 0.0);
+#else
+	printf("heap allocations: not counted (build with -DGAME_HEAP_STATS)\n");
+#endif
+	printf("enemy turn: %.3f us (%zu enemies awake)\n", turn_us, awake);
+	printf("draw: %.2f us/frame (composed, not written)\n", draw_us);
+	printf("rng: %.2f ns/draw\n", bench_rng_pass());
+	double leave_us, enter_us, stored, raw;
+	bench_store_pass(min(n, 500), &leave_us, &enter_us, &stored, &raw);
+	printf("level store: %.0f bytes/level (%.0f uncompressed), leave %.2f us, re-enter %.2f us\n",
+		stored, raw, leave_us, enter_us);
+	bench_stages(n);
+	perf_report();
+	if (forced) return;
+	perf_on = false; // keep the counters on the specialized path only
+	opt_dynamic_dims = true;
+	double dyn_turn_us = bench_turns_pass(n, &awake);
+	double dyn_us = bench_gen_pass(n, warmup, &heap, &spills);
+	opt_dynamic_dims = false;
+	printf("dynamic dims: gen %.2f us/level (%.2fx), enemy turn %.3f us (%.2fx)\n",
+		dyn_us, us > 0 ? dyn_us / us : 0.0, dyn_turn_us, turn_us > 0 ? dyn_turn_us / turn_us : 0.0);
+}
+
+/// Turn logic
+thread_local bool running = true;
+
+// Fresh character on level 1 of the given run seed
+void new_run(uint64_t seed) {
+	run_seed = seed;
+	coins = 0; moves = 0; torch = 30; level = 1; deepest_level = 1;
+	potions = 0; potions_used = 0; swordDamage = 2;
+	max_hp = 20; hp = 20; kills = 0;
+	player_defending = false;
+	game_end_reason = ""; game_end_code = END_QUIT;
+	turn_count = 0; enemies_noticed = 0;
+	journal_clear();
+	store_clear();
+	for (int st = 0; st < STAT_COUNT; st++) unlocked_tier[st] = -1;
+	running = true;
+	gen(level);
+}
+
+// Apply one movement/action key; returns true if the player spent a turn
+bool player_action(int k) {
+	journal_begin();
+	int oldx = x, oldy = y;
+	bool player_acted = false;
+	if (k == 'a' || k == 'd' || k == 'w' || k == 's') {
+		int tx = x, ty = y;
+		if (k == 'a') tx = x-1;
+		else if (k == 'd') tx = x+1;
+		else if (k == 'w') ty = y-1;
+		else if (k == 's') ty = y+1;
+		// Attack if enemy is there
+		int ei = enemy_at(tx, ty);
+		if (ei != -1) {
+			// attack enemy
+			int raw = swordDamage + rnd(combat_rng, swordDamage + 1);
+			int reduction = 0;
+			if (enemies[ei].defending) reduction = rnd(combat_rng, enemies[ei].damage + 1);
+			int dmg = raw - reduction; if (dmg < 0) dmg = 0;
+			enemies[ei].hp -= dmg;
+			player_acted = true;
+			emit(EV_ATTACK, enemies[ei].kind, dmg, reduction);
+			if (enemies[ei].hp <= 0) {
+				enemies[ei].alive = false;
+				emit(EV_KILL, enemies[ei].kind);
+				drop_loot((int)ei);
+			}
+		} else {
+			// attempt move
+			x = tx; y = ty; ++moves; player_acted = true;
+			bool descend = false;
+			switch (tile_table.look[tile(x, y)].action) {
+				case ACT_BLOCK: x = oldx; y = oldy; break;
+				case ACT_ITEM: pick_up_item(); break;
+				case ACT_DESCEND: descend = true; break;
+			}
+			// the step onto the stairs happens on this level, before EV_LEVEL
+			if (x != oldx || y != oldy) emit(EV_MOVE);
+			if (descend) change_level(level + 1);
+		}
+	}
+	else if (k == 'p') {
+		// use potion
+		if (potions > 0) {
+			int heal = 5 + rnd(combat_rng, 6); hp += heal; if (hp > max_hp) hp = max_hp; potions--; potions_used++; player_acted = true;
+			emit(EV_POTION, 0, heal);
+		}
+	}
+	else if (k == 'e') {
+		player_defending = true; player_acted = true;
+		emit(EV_DEFEND);
+	}
+	else if (k == '<') {
+		// climbing is a key of its own so walking across the stairs up is harmless
+		if (tile_table.look[tile(x, y)].action == ACT_ASCEND) { change_level(level - 1); player_acted = true; }
+	}
+	else if (k == 't') {
+		// set a torch down on an empty tile; it lights the area until picked up
+		int c = x * map_stride + y;
+		if (torch > TORCH_PLACE_COST && tile_table.look[lvl[c]].action == ACT_NONE) {
+			torch -= TORCH_PLACE_COST;
+			journal_tile(c);
+			lvl[c] |= TORCH;
+			update_target(c);
+			floor_torch_changed(c, true);
+			player_acted = true;
+			emit(EV_PLACE_TORCH, 0, TORCH_PLACE_COST);
+		}
+	}
+	if (player_acted) { turn_count++; reveal(); check_achievements(); }
+	return player_acted;
+}
+
+// Torch burn and death checks closing a world turn; false once the game is over
+bool end_of_turn_checks() {
+	bool alive = true;
+	if (--torch <= 0) { game_end_reason = "Your torch ran out."; game_end_code = END_TORCH; running = false; emit(EV_END, 0, END_TORCH); alive = false; }
+	else if (hp <= 0) { game_end_reason = "You were killed."; game_end_code = END_KILLED; running = false; emit(EV_END, 0, END_KILLED); alive = false; }
+	journal_commit();
+	return alive;
+}
+
+// Keys that are not turns: help, undo and quit
+bool ui_key(int k) {
+	if (k == 'u') {
+		if (undo_turn()) emit(EV_UNDO, 0, (int)turn_count);
+		else push_msg("Nothing to undo.");
+		draw();
+		return true;
+	}
+	if (k == 'h') {
+		show_help();
+		full_redraw = true;
+		draw();
+		return true;
+	}
+	if (k == KEY_ESCAPE) { game_end_reason = "Player quit the game."; game_end_code = END_QUIT; running = false; emit(EV_END, 0, END_QUIT); return true; }
+	return false;
+}
+
+// '>': walk down the distance field one world turn per step until the stairs
+// are taken, an enemy notices the player or stands next to them, or the game
+// ends
+void travel_to_stairs() {
+	int lv = level, noticed = enemies_noticed;
+	while (running && level == lv && adjacent_enemy_index() == -1) {
+		int k = stairs_step_key();
+		if (!k) break;
+		player_action(k);
+		process_enemies_turn();
+		draw();
+		if (!end_of_turn_checks() || enemies_noticed != noticed) break;
+	}
+}
+
+// 'o': auto-explore towards the nearest unseen tile or item with the same stop
+// rules as travel (or on any key), drawing one frame per EXPLORE_BATCH steps
+// and the one it stops on, each before the torch burns like every turn's frame
+#define EXPLORE_BATCH 4
+#define EXPLORE_MAX_STEPS 500
+void auto_explore() {
+	int lv = level, noticed = enemies_noticed;
+	bool drawn = false;
+	for (int step = 1; step <= EXPLORE_MAX_STEPS && running && level == lv && adjacent_enemy_index() == -1; step++) {
+		int k = explore_step_key();
+		if (!k) { push_msg("Nothing left to explore."); drawn = false; break; }
+		player_action(k);
+		process_enemies_turn();
+		bool stop = enemies_noticed != noticed || kbhit() || step == EXPLORE_MAX_STEPS || level != lv || adjacent_enemy_index() != -1;
+		drawn = stop || step % EXPLORE_BATCH == 0;
+		if (drawn) draw();
+		if (!end_of_turn_checks() || stop) break;
+	}
+	if (!drawn) draw();
+}
+
+// Classic loop: the world advances one turn per player action
+// Keys that arrive faster than frames can be shown (a held key, a slow link)
+// are all played, but only the state after the last one is drawn, except that
+// a frame is forced once opt_min_fps would otherwise be missed. A turn's frame
+// is drawn before its torch burn, as travel and auto-explore draw theirs.
+void run_turn_based() {
+	const long long frame_gap_ns = 1000000000LL / opt_min_fps;
+	long long last_frame = now_ns();
+	bool dirty = false; // turns played since the last frame
 	while (running) {
 		// Input
-		if (kbhit()) {
-			char k = getkey();
-
-			int oldx = x, oldy = y;
-			bool player_acted = false;
-			if (k == 'a' || k == 'd' || k == 'w' || k == 's') {
-				int tx = x, ty = y;
-				if (k == 'a') tx = x-1;
-				else if (k == 'd') tx = x+1;
-				else if (k == 'w') ty = y-1;
-				else if (k == 's') ty = y+1;
-				// Attack if enemy is there
-				int ei = enemy_at(tx, ty);
-				if (ei != -1) {
-					// attack enemy
-					int raw = swordDamage + rand() % (swordDamage + 1);
-					int reduction = 0;
-					if (enemies[ei].defending) reduction = rand() % (enemies[ei].damage + 1);
-					int dmg = raw - reduction; if (dmg < 0) dmg = 0;
-					enemies[ei].hp -= dmg;
-					player_acted = true;
-					push_msg("You hit the enemy for %d damage.", dmg);
-					if (enemies[ei].hp <= 0) {
-						enemies[ei].alive = false;
-						push_msg("Victory! You have defeated the enemy.");
-						drop_loot((int)ei);
-					}
-				} else {
-					// attempt move
-					x = tx; y = ty; ++moves; player_acted = true;
-					if (lvl[x][y] & WALL) { x = oldx; y = oldy; }
-					else if (lvl[x][y] & COIN) { coins++; lvl[x][y] ^= COIN; push_msg("You gain %d coins.", 1); }
-					else if (lvl[x][y] & TORCH) { torch+=20; lvl[x][y] ^= TORCH; push_msg("You found torch +%d.", 20); }
-					else if (lvl[x][y] & POTION) { ++potions; lvl[x][y] &= ~POTION; push_msg("You found a potion."); }
-					else if (lvl[x][y] & SWORD_ITEM) { int inc = 1 + rand()%2; swordDamage += inc; lvl[x][y] &= ~SWORD_ITEM; push_msg("You found a sword (+%d attack).", inc); }
-					else if (lvl[x][y] & STAIRS_DOWN) gen(++level);
-				}
+		if (!kbhit()) {
+			// a viewer that just joined needs a keyframe even while the player idles
+			if (dirty || spec_need_key) { draw(); frames_drawn++; last_frame = now_ns(); dirty = false; }
+			continue;
+		}
+		char k = getkey();
+		if (ui_key(k)) continue;
+		if (k == '>') { travel_to_stairs(); dirty = false; continue; }
+		if (k == 'o') { auto_explore(); dirty = false; continue; }
+
+		// After player action, enemies take their turns
+		if (player_action(k)) {
+			process_enemies_turn();
+			if (!kbhit() || now_ns() - last_frame >= frame_gap_ns) {
+				draw(); frames_drawn++; last_frame = now_ns(); dirty = false;
+			} else {
+				frames_coalesced++;
+				dirty = true; // drawn once the queue runs dry, should no turn follow
 			}
-			else if (k == 'p') {
-				// use potion
-				if (potions > 0) {
-					int heal = 5 + rand()%6; hp += heal; if (hp > max_hp) hp = max_hp; potions--; potions_used++; player_acted = true;
-					push_msg("You used a potion and recovered %d HP.", heal);
-				}
+			if (!end_of_turn_checks()) {
+				if (dirty) { draw(); frames_drawn++; }
+				break;
 			}
-			else if (k == 'e') {
-				player_defending = true; player_acted = true;
+		}
+	}
+}
+
+// Real-time loop: input is applied as it arrives, the world advances on a
+// fixed tick, and frames are paced to opt_fps with absolute-time sleeps.
+void run_realtime() {
+	const long long tick_ns = 1000000000LL / opt_tick_hz;
+	const long long frame_ns = 1000000000LL / opt_fps;
+	long long start = now_ns();
+	long long next_tick = start + tick_ns, next_frame = start;
+	long long tick_no = 0;
+	bool dirty = true;
+	while (running) {
+		while (running && kbhit()) {
+			int k = getkey();
+			if (ui_key(k)) { next_tick = now_ns() + tick_ns; dirty = true; continue; }
+			if (k == '>') k = stairs_step_key(); // one step per key against the clock
+			else if (k == 'o') k = explore_step_key();
+			if (player_action(k)) dirty = true;
+		}
+		if (!running) break;
+
+		long long now = now_ns();
+		// run due ticks; if we fell more than a few behind, drop the backlog
+		int steps = 0;
+		while (running && now >= next_tick && steps < 4) {
+			long long t0 = now_ns();
+			if (++tick_no % opt_turn_ticks == 0) {
+				process_enemies_turn();
+				end_of_turn_checks();
 			}
-			else if (k == 'h') {
-				show_help();
+			rt_tick.add(now_ns() - t0);
+			next_tick += tick_ns;
+			steps++;
+			dirty = true;
+		}
+		if (now - next_tick > 4 * tick_ns) {
+			long long behind = (now - next_tick) / tick_ns;
+			rt_late_ticks += behind;
+			next_tick += behind * tick_ns;
+		}
+
+		if (now >= next_frame) {
+			if (dirty) {
+				long long t0 = now_ns();
 				draw();
+				rt_render.add(now_ns() - t0);
+				dirty = false;
 			}
-			else if (k == KEY_ESCAPE) { game_end_reason = "Player quit the game."; running = false; }
+			next_frame += frame_ns;
+			if (next_frame < now) next_frame = now + frame_ns;
+		}
+		if (running) sleep_until_ns(next_tick < next_frame ? next_tick : next_frame);
+	}
+	rt_elapsed_ns = now_ns() - start;
+}
 
-			// After player action, enemies take their turns
-			if (player_acted) {
-				process_enemies_turn();
-				draw();
-				if (--torch <= 0) { game_end_reason = "Your torch ran out."; running = false; break; }
-				if (hp <= 0) { game_end_reason = "You were killed."; running = false; break; }
+/// Simulation
+// --simulate=N: play N complete runs with a scripted player on --threads
+// workers and write per-level survival, torch balance and score as CSV. Each
+// worker has its own copy of the game state (the globals are thread_local)
+// and takes runs in chunks from a shared counter. Run i always uses seed
+// mix64(base + i), so totals do not depend on the thread count.
+#define SIM_ITEM_REACH 4    // detour for items at most this many steps away
+#define SIM_MAX_TURNS 20000 // runs still going after this are cut off
+#define SIM_CHUNK 64
+
+thread_local std::vector<int8_t> bfs_first; // first step towards a cell, -1 = unseen
+thread_local std::vector<int16_t> bfs_dist;
+thread_local std::vector<int> bfs_queue;
+
+// Scripted player: drink below 40% HP, hit an adjacent enemy, otherwise take
+// the first step of a shortest path to the nearest item within reach (a BFS
+// cut off at that depth) or else down the stairs distance field. Paths go
+// through enemies: stepping into one attacks it.
+int bot_key() {
+	if (hp * 10 < max_hp * 4 && potions > 0) return 'p';
+	int ae = adjacent_enemy_index();
+	if (ae != -1) {
+		const Enemy &e = enemies[ae];
+		return e.x > x ? 'd' : e.x < x ? 'a' : e.y > y ? 's' : 'w';
+	}
+	const int off[4] = { map_stride, -map_stride, 1, -1 };
+	const int base = map_stride + 1; // lvl[i] is bfs_first[base + i]
+	size_t cells = (size_t)(map_w + 2) * map_stride + 1;
+	bfs_first.assign(cells, -1);
+	bfs_dist.resize(cells);
+	bfs_queue.clear();
+	int start = x * map_stride + y;
+	bfs_first[base + start] = 0;
+	bfs_dist[base + start] = 0;
+	bfs_queue.push_back(start);
+	for (size_t q = 0; q < bfs_queue.size(); q++) {
+		int c = bfs_queue[q];
+		int d = bfs_dist[base + c];
+		if (c != start && tile_table.look[lvl[c]].action == ACT_ITEM) return step_keys[bfs_first[base + c]];
+		if (d == SIM_ITEM_REACH) continue;
+		for (int k = 0; k < 4; k++) {
+			int n = c + off[k]; // the sentinel ring keeps n inside the grid
+			if (bfs_first[base + n] != -1 || (lvl[n] & WALL)) continue;
+			bfs_first[base + n] = c == start ? k : bfs_first[base + c];
+			bfs_dist[base + n] = d + 1;
+			bfs_queue.push_back(n);
+		}
+	}
+	int k = stairs_step_key();
+	return k ? k : 'e';
+}
+
+// Per-level sums; averages are taken when printing
+struct SimLevel {
+	long long reached = 0, cleared = 0;
+	long long died_torch = 0, died_killed = 0, cut_off = 0;
+	long long turns = 0, kills = 0;
+	long long torch_in = 0;   // torch on arrival
+	long long torch_gain = 0; // torch on leaving minus on arrival, cleared levels only
+	long long hp_out = 0;     // hp on leaving, cleared levels only
+	double score = 0;         // score when the level was left or the run ended on it
+};
+
+struct SimTotals {
+	std::vector<SimLevel> lv;
+	long long runs = 0, descents = 0, turns = 0, kills = 0;
+	double score = 0;
+	void add(const SimTotals &o) {
+		for (size_t i = 0; i < lv.size(); i++) {
+			SimLevel &a = lv[i];
+			const SimLevel &b = o.lv[i];
+			a.reached += b.reached; a.cleared += b.cleared;
+			a.died_torch += b.died_torch; a.died_killed += b.died_killed; a.cut_off += b.cut_off;
+			a.turns += b.turns; a.kills += b.kills;
+			a.torch_in += b.torch_in; a.torch_gain += b.torch_gain; a.hp_out += b.hp_out;
+			a.score += b.score;
+		}
+		runs += o.runs; descents += o.descents; turns += o.turns; kills += o.kills; score += o.score;
+	}
+};
+
+void sim_run(uint64_t seed, SimTotals &t) {
+	new_run(seed);
+	int cur = level, turn_in = 0, kills_in = 0, torch_in = torch;
+	t.lv[cur].reached++;
+	t.lv[cur].torch_in += torch;
+	int turn = 0;
+	bool ended = false;
+	while (!ended && turn < SIM_MAX_TURNS) {
+		if (!player_action(bot_key())) player_action('e');
+		turn++;
+		if (level != cur) {
+			SimLevel &l = t.lv[cur];
+			l.cleared++; l.turns += turn - turn_in; l.kills += kills - kills_in;
+			l.torch_gain += torch - torch_in; l.hp_out += hp;
+			l.score += compute_score(current_stats(), unlocked_points());
+			if (level > opt_sim_levels) { t.descents++; break; }
+			cur = level; turn_in = turn; kills_in = kills; torch_in = torch;
+			t.lv[cur].reached++;
+			t.lv[cur].torch_in += torch;
+		}
+		process_enemies_turn();
+		ended = !end_of_turn_checks();
+	}
+	long score = compute_score(current_stats(), unlocked_points());
+	if (level == cur) {
+		// the run ended (or was cut off) on this level
+		SimLevel &l = t.lv[cur];
+		if (!ended) l.cut_off++;
+		else if (game_end_code == END_TORCH) l.died_torch++;
+		else l.died_killed++;
+		l.turns += turn - turn_in; l.kills += kills - kills_in;
+		l.score += score;
+	}
+	t.runs++; t.turns += turn; t.kills += kills; t.score += score;
+}
+
+void sim_worker(std::atomic<long long> *next, long long n, uint64_t base, SimTotals *t) {
+	for (;;) {
+		long long i0 = next->fetch_add(SIM_CHUNK);
+		if (i0 >= n) break;
+		long long i1 = min(i0 + SIM_CHUNK, n);
+		for (long long i = i0; i < i1; i++) sim_run(mix64(base + (uint64_t)i), *t);
+	}
+}
+
+bool run_simulation() {
+	FILE *out = stdout;
+	if (opt_csv_path.size() && !(out = fopen(opt_csv_path.c_str(), "w"))) { perror(opt_csv_path.c_str()); return false; }
+	int nthreads = opt_threads > 0 ? opt_threads : (int)std::thread::hardware_concurrency();
+	if (nthreads < 1) nthreads = 1;
+	std::vector<SimTotals> part(nthreads);
+	for (int i = 0; i < nthreads; i++) part[i].lv.resize(opt_sim_levels + 2);
+	std::atomic<long long> next{0};
+	long long t0 = now_ns();
+	std::vector<std::thread> workers;
+	for (int i = 0; i < nthreads; i++) workers.emplace_back(sim_worker, &next, opt_simulate, run_seed, &part[i]);
+	for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+	double secs = (now_ns() - t0) / 1e9;
+	for (int i = 1; i < nthreads; i++) part[0].add(part[i]);
+	const SimTotals &t = part[0];
+
+	fprintf(out, "level,reached,survival,died_torch,died_killed,cut_off,turns,kills,torch_in,torch_balance,hp_out,score\n");
+	for (int lv = 1; lv <= opt_sim_levels; lv++) {
+		const SimLevel &l = t.lv[lv];
+		if (l.reached == 0) break;
+		double r = (double)l.reached, c = l.cleared ? (double)l.cleared : 1.0;
+		fprintf(out, "%d,%lld,%.4f,%lld,%lld,%lld,%.2f,%.3f,%.2f,%.2f,%.2f,%.1f\n", lv, l.reached, l.cleared / r,
+			l.died_torch, l.died_killed, l.cut_off, l.turns / r, l.kills / r, l.torch_in / r,
+			l.torch_gain / c, l.hp_out / c, l.score / r);
+	}
+	if (out != stdout) fclose(out);
+	fprintf(stderr, "simulated %lld runs (seed %llu) on %d threads in %.1fs, %.0f runs/s\n",
+		t.runs, (unsigned long long)run_seed, nthreads, secs, secs > 0 ? t.runs / secs : 0.0);
+	fprintf(stderr, "mean score %.1f, %.2f turns and %.2f fights won per run, %lld full descents to level %d\n",
+		t.runs ? t.score / t.runs : 0.0, t.runs ? (double)t.turns / t.runs : 0.0,
+		t.runs ? (double)t.kills / t.runs : 0.0, t.descents, opt_sim_levels);
+	return true;
+}
+
+/// Latency harness
+// --bench-latency=N: run this game under a pseudo-terminal (--no-intro,
+// --enemies=0, a fixed seed), type N keys from --latency-keys one at a time
+// and time each from write() to the end of the next complete frame. The pty
+// side answers the DECRQM/DA probe so the game brackets frames with DEC 2026
+// sync markers, and a minimal screen model (cursor moves, newlines, text)
+// tracks where the '@' was drawn. Reports a log2 latency histogram,
+// percentiles and bytes per keystroke. Each game is restarted before its torch
+// can run out.
+#ifndef _WIN32
+#define LAT_KEYS_PER_GAME 20
+#define LAT_TIMEOUT_MS 2000
+
+// Follows the game's output far enough to know when a frame ends and where '@' is
+struct ScreenModel {
+	int row = 1, col = 1;
+	int at_row = 0, at_col = 0; // '@' in the frame being drawn
+	int frames = 0;             // completed frames
+	int frame_row = 0, frame_col = 0; // '@' of the last completed frame
+	bool probed = false;        // saw the capability query
+	int state = 0;              // 0 text, 1 after ESC, 2 in CSI
+	std::string csi;
+
+	void feed(const char *p, size_t n) {
+		for (size_t i = 0; i < n; i++) {
+			char c = p[i];
+			if (state == 1) { state = c == '[' ? 2 : 0; csi.clear(); continue; }
+			if (state == 2) {
+				if (c >= 0x40 && c <= 0x7e) { state = 0; csi_end(c); }
+				else csi += c;
+				continue;
+			}
+			if (c == 27) state = 1;
+			else if (c == '\r') col = 1;
+			else if (c == '\n') { row++; col = 1; }
+			else if ((unsigned char)c >= 32) {
+				if (c == '@') { at_row = row; at_col = col; }
+				col++;
+			}
+		}
+	}
+	void csi_end(char f) {
+		if (f == 'H') {
+			row = 1; col = 1;
+			sscanf(csi.c_str(), "%d;%d", &row, &col);
+		} else if (f == 'h' && csi == "?2026") {
+			at_row = at_col = 0;
+		} else if (f == 'l' && csi == "?2026") {
+			frames++; frame_row = at_row; frame_col = at_col;
+		} else if (f == 'p' && csi == "?2026$") {
+			probed = true;
+		}
+	}
+};
+
+struct PtyGame {
+	pid_t pid = -1;
+	int fd = -1;
+	ScreenModel screen;
+	long long bytes = 0;
+
+	bool start(const char *exe, uint64_t seed) {
+		fd = posix_openpt(O_RDWR | O_NOCTTY);
+		if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) { perror("pty"); return false; }
+		struct winsize ws;
+		memset(&ws, 0, sizeof(ws));
+		ws.ws_row = 40; ws.ws_col = 120;
+		ioctl(fd, TIOCSWINSZ, &ws);
+		std::string slave = ptsname(fd);
+		char seed_arg[40];
+		snprintf(seed_arg, sizeof(seed_arg), "--seed=%llu", (unsigned long long)seed);
+		pid = fork();
+		if (pid < 0) { perror("fork"); return false; }
+		if (pid == 0) {
+			setsid();
+			int s = open(slave.c_str(), O_RDWR); // becomes the controlling terminal
+			if (s < 0) _exit(127);
+			dup2(s, 0); dup2(s, 1); dup2(s, 2);
+			if (s > 2) close(s);
+			close(fd);
+			setenv("TERM", "xterm-256color", 1);
+			// argv[0] may be a bare name found through PATH; this binary is at /proc/self/exe
+			execl("/proc/self/exe", exe, "--no-intro", "--no-history", "--enemies=0", seed_arg, (char *)NULL);
+			execlp(exe, exe, "--no-intro", "--no-history", "--enemies=0", seed_arg, (char *)NULL);
+			_exit(127);
+		}
+		screen = ScreenModel();
+		// answer the sync-mode probe, then wait for the first frame
+		if (!pump_until([this] { return screen.probed; })) return false;
+		const char reply[] = "\033[?2026;2$y\033[?62;22c";
+		if (write(fd, reply, sizeof(reply) - 1) < 0) return false;
+		return pump_until([this] { return screen.frames > 0; });
+	}
+
+	// Read output until done() holds; false on timeout or exit
+	template <class F> bool pump_until(F done) {
+		char buf[65536];
+		long long deadline = now_ns() + LAT_TIMEOUT_MS * 1000000LL;
+		while (!done()) {
+			long long left = (deadline - now_ns()) / 1000000;
+			if (left <= 0) return false;
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			if (poll(&pfd, 1, (int)left) <= 0) continue;
+			ssize_t n = read(fd, buf, sizeof(buf));
+			if (n <= 0) return false;
+			bytes += n;
+			screen.feed(buf, (size_t)n);
+		}
+		return true;
+	}
+
+	void stop() {
+		if (pid > 0) { kill(pid, SIGKILL); waitpid(pid, NULL, 0); }
+		if (fd >= 0) close(fd);
+		pid = -1; fd = -1;
+	}
+};
+
+bool bench_latency(const char *exe, int n) {
+	std::vector<long long> lat;
+	std::vector<long long> key_bytes;
+	int moved = 0, games = 0, lost = 0;
+	PtyGame g;
+	for (int i = 0; i < n; ) {
+		if (!g.start(exe, run_seed + games)) { g.stop(); fprintf(stderr, "could not start the game under a pty\n"); return false; }
+		games++;
+		for (int k = 0; k < LAT_KEYS_PER_GAME && i < n; k++, i++) {
+			char key = opt_latency_keys[i % opt_latency_keys.size()];
+			int frames0 = g.screen.frames, row0 = g.screen.frame_row, col0 = g.screen.frame_col;
+			long long bytes0 = g.bytes;
+			long long t0 = now_ns();
+			if (write(g.fd, &key, 1) != 1 || !g.pump_until([&] { return g.screen.frames > frames0; })) { lost++; break; }
+			lat.push_back(now_ns() - t0);
+			key_bytes.push_back(g.bytes - bytes0);
+			if (g.screen.frame_row != row0 || g.screen.frame_col != col0) moved++;
+			sleep_until_ns(now_ns() + 2000000); // let the game go idle between keys
+		}
+		g.stop();
+	}
+	if (lat.empty()) { fprintf(stderr, "no frames observed\n"); return false; }
+
+	std::vector<long long> sorted = lat;
+	std::sort(sorted.begin(), sorted.end());
+	auto pct = [&](double p) { return sorted[(size_t)(p * (sorted.size() - 1))] / 1000.0; };
+	long long total_bytes = 0, max_bytes = 0;
+	for (size_t i = 0; i < key_bytes.size(); i++) { total_bytes += key_bytes[i]; if (key_bytes[i] > max_bytes) max_bytes = key_bytes[i]; }
+	printf("latency: %zu keystrokes over %d games, %d moved '@', %d lost\n", lat.size(), games, moved, lost);
+	printf("  p50 %.1fus  p90 %.1fus  p99 %.1fus  max %.1fus\n", pct(0.5), pct(0.9), pct(0.99), sorted.back() / 1000.0);
+	printf("  bytes per keystroke: avg %.0f, max %lld\n", (double)total_bytes / key_bytes.size(), max_bytes);
+	// log2 buckets in microseconds
+	int hist[24] = {0};
+	for (size_t i = 0; i < lat.size(); i++) {
+		long long us = lat[i] / 1000;
+		int b = 0;
+		while (b < 23 && (1LL << (b + 1)) <= us) b++;
+		hist[b]++;
+	}
+	for (int b = 0; b < 24; b++) {
+		if (!hist[b]) continue;
+		int bar = (int)(50.0 * hist[b] / lat.size() + 0.5);
+		printf("  %7lld-%-7lldus %6d %s\n", 1LL << b, (1LL << (b + 1)) - 1, hist[b], std::string(bar, '#').c_str());
+	}
+	return true;
+}
+#else
+bool bench_latency(const char *, int) {
+	fprintf(stderr, "--bench-latency needs a POSIX pseudo-terminal\n");
+	return false;
+}
+#endif
+
+/// Batch environments
+// The C API declared in rlenv.h: K independent games for bot training, linked
+// into another program by building with -DGAME_NO_MAIN. Each game's state
+// (player fields, level pointers, enemies and its own level arena) lives in an
+// EnvState. Environments are split evenly over persistent worker threads; a
+// worker swaps an EnvState into its thread-locals, plays the action with the
+// same code as the terminal game and swaps it back out.
+
+// Thread-locals that make up one game, swapped whole between environments;
+// value-initialized, so a game never reset is not running and has no level
+#define ENV_STATE(X) \
+	X(gen_rng) X(combat_rng) X(run_seed) X(level_arena) X(map_stride) X(lvl) X(x) X(y) X(coins) X(moves) \
+	X(torch) X(level) X(deepest_level) X(potions) X(potions_used) X(swordDamage) X(max_hp) X(hp) X(kills) \
+	X(player_defending) X(enemies_noticed) X(game_end_code) X(turn_count) X(unlocked_tier) \
+	X(stairs_dist) X(dist_queue) X(seen) X(target_pos) X(target_dense) X(target_count) \
+	X(explore_prev) X(explore_path) X(explore_len) X(explore_goal) X(light) X(light_fresh) X(lit_x) X(lit_y) X(lit_radius) \
+	X(level_store) X(level_store_bytes) X(level_store_clock) X(level_store_dropped) \
+	X(running)
+
+struct EnvState {
+#define X(v) std::remove_reference_t<decltype(::v)> v{};
+	ENV_STATE(X)
+#undef X
+	LevelArena arena;
+	std::pmr::vector<Enemy> enemies;
+	long score = 0;
+	EnvState() : enemies(&arena_router) { level_arena = &arena; } // on its worker thread
+};
+
+void env_swap(EnvState &s) {
+#define X(v) std::swap(::v, s.v);
+	ENV_STATE(X)
+#undef X
+	::enemies.swap(s.enemies);
+}
+
+struct rlenv {
+	int k;
+	rlenv_obs obs;
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake, idle;
+	int cmd = 0;               // RLENV_* for the current generation
+	long long generation = 0;  // bumped per command
+	int busy = 0;              // workers still on it
+	const uint64_t *seeds = NULL;
+	const uint8_t *mask = NULL;
+	const char *actions = NULL;
+};
+enum { RLENV_RESET = 1, RLENV_STEP, RLENV_QUIT };
+
+// Current state of the swapped-in game into slot i of the observation arrays
+void env_observe(rlenv *env, int i) {
+	int w = map_w, h = map_h;
+	uint8_t *t = env->obs.tiles + (size_t)i * w * h;
+	if (!lvl) memset(t, 0, (size_t)w * h); // stepped before its first reset
+	else for (int c = 0; c < w; c++) memcpy(t + c * h, lvl + c * map_stride, h);
+	for (size_t e = 0; e < enemies.size(); e++)
+		if (enemies[e].alive) t[enemies[e].x * h + enemies[e].y] |= ENEMY_MARK;
+	int32_t *hud = env->obs.hud;
+	int k = env->k;
+	hud[HUD_X * k + i] = x; hud[HUD_Y * k + i] = y;
+	hud[HUD_HP * k + i] = hp; hud[HUD_MAX_HP * k + i] = max_hp;
+	hud[HUD_TORCH * k + i] = torch; hud[HUD_COINS * k + i] = coins;
+	hud[HUD_POTIONS * k + i] = potions; hud[HUD_SWORD * k + i] = swordDamage;
+	hud[HUD_LEVEL * k + i] = level; hud[HUD_KILLS * k + i] = kills;
+	hud[HUD_MOVES * k + i] = moves;
+	env->obs.done[i] = !running;
+}
+
+void env_worker(rlenv *env, int lo, int hi) {
+	std::vector<std::unique_ptr<EnvState>> mine; // built here, on this thread's router
+	for (int i = lo; i < hi; i++) mine.emplace_back(new EnvState());
+	long long seen_gen = 0;
+	for (;;) {
+		int cmd;
+		{
+			std::unique_lock<std::mutex> g(env->lock);
+			env->wake.wait(g, [&] { return env->generation != seen_gen; });
+			seen_gen = env->generation;
+			cmd = env->cmd;
+		}
+		if (cmd == RLENV_QUIT) break;
+		for (int i = lo; i < hi; i++) {
+			if (cmd == RLENV_RESET && env->mask && !env->mask[i]) continue;
+			EnvState &s = *mine[i - lo];
+			env_swap(s);
+			if (cmd == RLENV_RESET) {
+				new_run(env->seeds[i]);
+				s.score = compute_score(current_stats(), unlocked_points());
+				env->obs.reward[i] = 0;
+			} else if (running) {
+				if (player_action(env->actions[i])) {
+					process_enemies_turn();
+					end_of_turn_checks();
+				}
+				long score = compute_score(current_stats(), unlocked_points());
+				env->obs.reward[i] = (float)(score - s.score);
+				s.score = score;
+			} else {
+				env->obs.reward[i] = 0;
 			}
+			env_observe(env, i);
+			env_swap(s);
 		}
+		std::lock_guard<std::mutex> g(env->lock);
+		if (--env->busy == 0) env->idle.notify_one();
 	}
+	mine.clear();
+}
+
+// Run one command on every worker and wait for all of them
+void env_command(rlenv *env, int cmd) {
+	std::unique_lock<std::mutex> g(env->lock);
+	env->cmd = cmd;
+	env->busy = (int)env->workers.size();
+	env->generation++;
+	env->wake.notify_all();
+	if (cmd != RLENV_QUIT) env->idle.wait(g, [env] { return env->busy == 0; });
+}
+
+extern "C" {
+
+rlenv *rlenv_create(int k, int threads, const rlenv_obs *obs) {
+	if (k < 1) return NULL;
+	if (threads < 1) threads = (int)std::thread::hardware_concurrency();
+	if (threads < 1) threads = 1;
+	if (threads > k) threads = k;
+	rlenv *env = new rlenv();
+	env->k = k;
+	env->obs = *obs;
+	for (int t = 0; t < threads; t++)
+		env->workers.emplace_back(env_worker, env, (int)((long long)k * t / threads), (int)((long long)k * (t + 1) / threads));
+	return env;
+}
+
+void rlenv_reset(rlenv *env, const uint64_t *seeds, const uint8_t *mask) {
+	env->seeds = seeds;
+	env->mask = mask;
+	env_command(env, RLENV_RESET);
+}
+
+void rlenv_step(rlenv *env, const char *actions) {
+	env->actions = actions;
+	env_command(env, RLENV_STEP);
+}
+
+void rlenv_destroy(rlenv *env) {
+	if (!env) return;
+	env_command(env, RLENV_QUIT);
+	for (size_t t = 0; t < env->workers.size(); t++) env->workers[t].join();
+	delete env;
+}
+
+}
+
+// --bench-batch=K: K environments on --threads workers, random actions,
+// resetting every game that ends
+void bench_batch(int k) {
+	std::vector<uint8_t> tiles((size_t)k * map_w * map_h), done(k);
+	std::vector<int32_t> hud((size_t)RLENV_HUD_FIELDS * k);
+	std::vector<float> reward(k);
+	rlenv_obs obs = { tiles.data(), hud.data(), reward.data(), done.data() };
+	rlenv *env = rlenv_create(k, opt_threads, &obs);
+	std::vector<uint64_t> seeds(k);
+	for (int i = 0; i < k; i++) seeds[i] = mix64(run_seed + i);
+	rlenv_reset(env, seeds.data(), NULL);
+	std::vector<char> actions(k);
+	const char keys[6] = { 'w', 'a', 's', 'd', 'p', 'e' };
+	uint64_t r = run_seed;
+	long long steps = 0, games = 0, step_ns = 0;
+	double total_reward = 0;
+	long long t0 = now_ns();
+	while (now_ns() - t0 < 2000000000LL) {
+		for (int i = 0; i < k; i++) { r = mix64(r); actions[i] = keys[r % 6]; }
+		long long s0 = now_ns();
+		rlenv_step(env, actions.data());
+		step_ns += now_ns() - s0;
+		steps += k;
+		long long ended = 0;
+		for (int i = 0; i < k; i++) { total_reward += reward[i]; ended += done[i]; }
+		if (ended) {
+			for (int i = 0; i < k; i++) if (done[i]) seeds[i] = mix64(seeds[i]);
+			rlenv_reset(env, seeds.data(), done.data());
+			games += ended;
+		}
+	}
+	double secs = step_ns / 1e9;
+	printf("batch: %d envs on %zu threads, %lld steps in %.2fs of stepping: %.0f steps/s, %.1f ns/step per env\n",
+		k, env->workers.size(), steps, secs, secs > 0 ? steps / secs : 0.0, steps ? step_ns * 1.0 * env->workers.size() / steps : 0.0);
+	printf("  %lld games finished, mean reward per step %.3f\n", games, steps ? total_reward / steps : 0.0);
+	rlenv_destroy(env);
+}
+
+/// Main loop and input handling
+#ifndef GAME_NO_MAIN
+int main(int argc, char **argv) {
+	if (!parse_args(argc, argv)) return 1;
+	if (!opt_seed_given) run_seed = mix64((uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count());
+	if (opt_scores > 0) { print_scores(opt_scores); return 0; }
+	if (opt_perf) perf_init();
+	if (opt_bench_gen > 0) { bench_gen(opt_bench_gen); return 0; }
+	if (opt_simulate > 0) return run_simulation() ? 0 : 1;
+	if (opt_bench_latency > 0) return bench_latency(argv[0], opt_bench_latency) ? 0 : 1;
+	if (opt_build_pack.size()) return build_pack() ? 0 : 1;
+	if (opt_bench_batch > 0) { bench_batch(opt_bench_batch); return 0; }
+	LevelPack pack;
+	if (opt_pack_path.size()) {
+		if (!pack.open(opt_pack_path)) return 1;
+		level_pack = &pack;
+	}
+	subscribe(message_subscriber);
+	if (opt_telemetry_path.size() && !telemetry_start()) return 1;
+	if (opt_spectate_port > 0 && !spectate_start()) return 1;
+	detectTermCaps();
+	if (caps->tty) {
+		term_sync = caps->sync;
+		enterAltScreen();
+		term_alt = true;
+		atexit(restore_terminal);
+		signal(SIGINT, on_fatal_signal);
+		signal(SIGTERM, on_fatal_signal);
+	}
+	hidecursor();
+	saveDefaultColor();
+	if (!opt_realtime && opt_undo_depth > 0) journal_init();
+	new_run(run_seed);
+
+	if (!opt_no_intro) show_begining();
+	full_redraw = true;
+
+	emit(EV_START);
+	draw();
+	if (opt_realtime) run_realtime();
+	else run_turn_based();
+	telemetry_finish();
+	spectate_finish();
 
 	// Final summary and achievements
 	cls();
@@ -600,7 +4087,7 @@ int main() {
 	printf("=== Game Summary ===\n\n");
 	setColor(WHITE);
 	if (game_end_reason.size()) printf("Reason: %s\n\n", game_end_reason.c_str());
-	printf("Level reached: %d\n", level);
+	printf("Level reached: %d\n", deepest_level);
 	printf("Sword: %d\n", swordDamage);
 	printf("Moves: %d\n", moves);
 	printf("Coins: %d\n", coins);
@@ -608,54 +4095,69 @@ int main() {
 	printf("Potions (left): %d  (used: %d)\n", potions, potions_used);
 	printf("Kills: %d\n", kills);
 	printf("HP: %d/%d\n\n", hp, max_hp);
+	if (opt_realtime) {
+		double secs = rt_elapsed_ns / 1e9;
+		printf("Real-time: %lld ticks in %.1fs (%.1f Hz of %d), %lld late\n",
+			rt_tick.count, secs, secs > 0 ? rt_tick.count / secs : 0.0, opt_tick_hz, rt_late_ticks);
+		printf("  tick   avg %.1fus max %.1fus\n", rt_tick.avg_us(), rt_tick.max_ns / 1000.0);
+		printf("  render avg %.1fus max %.1fus, %lld frames (cap %d fps)\n\n",
+			rt_render.avg_us(), rt_render.max_ns / 1000.0, rt_render.count, opt_fps);
+	}
+
+	if (!opt_realtime && frames_coalesced > 0)
+		printf("Frames: %lld drawn, %lld coalesced under input bursts\n\n", frames_drawn, frames_coalesced);
+
+	if (opt_perf) { perf_report(); printf("\n"); }
+
+	if (opt_spectate_port > 0)
+		printf("Spectators: %lld viewers, %lld frames, %lld keyframes, %lld frames skipped for slow viewers\n\n",
+			spec_viewers_total, spec_frames, spec_keyframes, spec_dropped);
+
+	if (level_pack)
+		printf("Level pack: %lld levels loaded, %lld generated and saved\n\n", level_pack->hits, level_pack->misses);
+
+	if (opt_telemetry_path.size())
+		printf("Telemetry: %llu events to %s, %llu dropped\n\n", telemetry_sent, opt_telemetry_path.c_str(), telemetry_dropped);
 
 	printf("Achievements:\n");
+	RunStats final_stats = current_stats();
 	int ach = 0;
-	if (kills >= 1000) { printf(" - Slayer (1000 kills)\n"); ach += 8; }
-	else if (kills >= 500) { printf(" - One-Man Army (500 kills)\n"); ach += 7; }
-	else if (kills >= 250) { printf(" - Executioner (250 kills)\n"); ach += 6; }
-	else if (kills >= 100) { printf(" - Butcher (100 kills)\n"); ach += 5; }
-	else if (kills >= 50) { printf(" - Merciless (50 kills)\n"); ach += 4; }
-	else if (kills >= 25) { printf(" - Reckless (25 kills)\n"); ach += 3; }
-	else if (kills >= 10) { printf(" - Skirmisher (10 kills)\n"); ach += 2; }
-	else if (kills >= 1) { printf(" - First Blood\n"); ach++; }
-	if (coins >= 1000) { printf(" - Filthy Rich (1000 coins)\n"); ach += 6; }
-	else if (coins >= 750) { printf(" - Tycoon (750 coins)\n"); ach += 5; }
-	else if (coins >= 500) { printf(" - Deep Pockets (500 coins)\n"); ach += 4; }
-	else if (coins >= 250) { printf(" - Entrepreneur (250 coins)\n"); ach += 3; }
-	else if (coins >= 100) { printf(" - Well-to-do (100 coins)\n"); ach += 2; }
-	else if (coins >= 50) { printf(" - Pocket Change (50 coins)\n"); ach++; }
-	if (potions >= 200) { printf(" - The Human Flask (200 potions)\n"); ach += 5; }
-	else if (potions >= 100) { printf(" - Apothecary's Friend (100 potions)\n"); ach += 4; }
-	else if (potions >= 50) { printf(" - Lifeline (50 potions)\n"); ach += 3; }
-	else if (potions >= 25) { printf(" - Stockpiler (25 potions)\n"); ach += 2; }
-	else if (potions >= 5) { printf(" - Taste Tester (5 potions)\n"); ach++; }
-	if (level >= 100) { printf(" - The Human Flask (100 levels)\n"); ach += 7; }
-	else if (level >= 75) { printf(" - Labyrinth Master (50 levels)\n"); ach += 6; }
-	else if (level >= 50) { printf(" - Abyssal Voyager (50 levels)\n"); ach += 5; }
-	else if (level >= 25) { printf(" - Deep Diver (25 levels)\n"); ach += 4; }
-	else if (level >= 10) { printf(" - Spelunker (10 levels)\n"); ach += 3; }
-	else if (level >= 5) { printf(" - Taste Tester (5 levels)\n"); ach += 2; }
-	else if (level > 1) { printf(" - First Step (more than 1 level)\n"); ach++; }
+	for (int st = 0; st < STAT_COUNT; st++) {
+		int tier = unlocked_tier[st];
+		if (tier < 0) continue;
+		printf(" - %s\n", ladders[st].tiers[tier].title);
+		ach += ladders[st].tiers[tier].points;
+	}
 	if (ach == 0) printf(" none\n");
 
-	// Score calculation
-	long score = 0;
-	score += (long)kills * 100;
-	score += (long)coins * 2;
-	score += (long)level * 500;
-	score += (long)swordDamage * 50;
-	score += (long)hp * 10;
-	score += (long)potions_used * 20;
-	score += (long)ach * 500;
-	score -= (long)moves; // penalty for too many moves
+	long score = compute_score(final_stats, ach);
 	printf("\nFinal Score: %ld\n", score);
 
+	// Record the run and show where it stands
+	if (opt_history) {
+		RunRecord rec;
+		memset(&rec, 0, sizeof(rec));
+		rec.seed = run_seed; rec.score = score; rec.time = (int64_t)time(NULL);
+		rec.level = final_stats.level; rec.kills = final_stats.kills; rec.coins = final_stats.coins; rec.moves = final_stats.moves;
+		rec.sword = final_stats.sword; rec.hp = final_stats.hp; rec.potions_used = final_stats.potions_used; rec.potions = final_stats.potions;
+		rec.achievements = ach; rec.end_code = game_end_code;
+		HistoryStanding st;
+		if (history_append(&rec, 1, NULL) && history_query(score, run_seed, 5, &st)) {
+			printf("Rank %llu of %llu (better than %.1f%% of runs)\n", (unsigned long long)st.better + 1,
+				(unsigned long long)st.total, st.total > 1 ? 100.0 * (st.total - 1 - st.better) / (st.total - 1) : 100.0);
+			if (st.has_seed_best) printf("Best for seed %llu: %lld\n", (unsigned long long)run_seed, (long long)st.seed_best.score);
+			printf("Top runs:\n");
+			for (size_t i = 0; i < st.top.size(); i++) print_run_line((int)i + 1, st.top[i]);
+		}
+	}
+
 	anykey("\nPress any key to exit...\n");
 
 	cls();
 	resetColor();
 	showcursor();
+	restore_terminal();
 
 	return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
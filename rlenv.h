@@ -0,0 +1,41 @@
+#pragma once
+/// rlenv: K independent games stepped in lockstep, for bot training.
+/// Build main.cpp with -DGAME_NO_MAIN and link it into a C or C++ program.
+///
+/// Observations are structure-of-arrays in caller memory, written in place by
+/// every reset and step: tiles is k * map_w * map_h bytes, env-major then
+/// column-major, holding the game's tile flags with 128 on living enemies;
+/// hud is RLENV_HUD_FIELDS arrays of k ints; reward is the score gained by the
+/// step; done is set once a game ends, which then ignores actions until it is
+/// reset. A game that was never reset reports done and all-zero tiles.
+/// Levels left behind are not kept: climbing back up with '<' generates the
+/// level above afresh.
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum HudField { HUD_X, HUD_Y, HUD_HP, HUD_MAX_HP, HUD_TORCH, HUD_COINS, HUD_POTIONS, HUD_SWORD,
+	HUD_LEVEL, HUD_KILLS, HUD_MOVES, RLENV_HUD_FIELDS };
+
+typedef struct rlenv_obs {
+	uint8_t *tiles;
+	int32_t *hud;  // hud[field * k + env]
+	float *reward;
+	uint8_t *done;
+} rlenv_obs;
+
+typedef struct rlenv rlenv;
+
+// k games on threads workers (< 1 = one per core); obs must outlive the env
+rlenv *rlenv_create(int k, int threads, const rlenv_obs *obs);
+// Start game i on run seed seeds[i] where mask[i] is set (mask NULL = all)
+void rlenv_reset(rlenv *env, const uint64_t *seeds, const uint8_t *mask);
+// One key per game: w/a/s/d/p/e/t/<
+void rlenv_step(rlenv *env, const char *actions);
+void rlenv_destroy(rlenv *env);
+
+#ifdef __cplusplus
+}
+#endif
@@ -43,6 +43,8 @@
 	#include <iostream>
 	#include <string>
 	#include <cstdio> // for getch()
+	#include <cstdlib> // for getenv()
+	#include <cstring> // for strstr()
 	/// Namespace forward declarations
 	namespace rlutil {
 		RLUTIL_INLINE void locate(int x, int y);
@@ -50,6 +52,7 @@
 #else
 	#include <stdio.h> // for getch() / printf()
 	#include <string.h> // for strlen()
+	#include <stdlib.h> // for getenv()
 	RLUTIL_INLINE void locate(int x, int y); // Forward declare for C to avoid warnings
 #endif // __cplusplus
 
@@ -65,6 +68,7 @@
 	#include <sys/ioctl.h> // for getkey()
 	#include <sys/types.h> // for kbhit()
 	#include <sys/time.h> // for kbhit()
+	#include <fcntl.h> // for terminfoColors()
 
 /// Function: getch
 /// Get character without waiting for Return to be pressed.
@@ -195,6 +199,11 @@ enum {
  * ANSI_CURSOR_HIDE        - Hides the cursor
  * ANSI_CURSOR_SHOW        - Shows the cursor
  * ANSI_CURSOR_HOME        - Moves the cursor home (0,0)
+ * ANSI_ALT_SCREEN_ON      - Switches to the alternate screen buffer
+ * ANSI_ALT_SCREEN_OFF     - Switches back to the normal screen buffer
+ * ANSI_SYNC_BEGIN         - Starts a synchronized update (DEC mode 2026)
+ * ANSI_SYNC_END           - Ends a synchronized update and presents it
+ * ANSI_SCROLL_REGION_RESET - Resets the scroll region to the whole screen
  * ANSI_BLACK              - Black
  * ANSI_RED                - Red
  * ANSI_GREEN              - Green
@@ -227,6 +236,11 @@ const RLUTIL_STRING_T ANSI_ATTRIBUTE_RESET    = "\033[0m";
 const RLUTIL_STRING_T ANSI_CURSOR_HIDE        = "\033[?25l";
 const RLUTIL_STRING_T ANSI_CURSOR_SHOW        = "\033[?25h";
 const RLUTIL_STRING_T ANSI_CURSOR_HOME        = "\033[H";
+const RLUTIL_STRING_T ANSI_ALT_SCREEN_ON      = "\033[?1049h";
+const RLUTIL_STRING_T ANSI_ALT_SCREEN_OFF     = "\033[?1049l";
+const RLUTIL_STRING_T ANSI_SYNC_BEGIN         = "\033[?2026h";
+const RLUTIL_STRING_T ANSI_SYNC_END           = "\033[?2026l";
+const RLUTIL_STRING_T ANSI_SCROLL_REGION_RESET = "\033[r";
 const RLUTIL_STRING_T ANSI_BLACK              = "\033[22;30m";
 const RLUTIL_STRING_T ANSI_RED                = "\033[22;31m";
 const RLUTIL_STRING_T ANSI_GREEN              = "\033[22;32m";
@@ -451,6 +465,137 @@ RLUTIL_INLINE RLUTIL_STRING_T getANSIBackgroundColor(const int c) {
 	}
 }
 
+/**
+ * Struct: TermCaps
+ * What the output terminal can do. Filled in once by <detectTermCaps>;
+ * until then rlutil behaves as before (ANSI, legacy 8-color escapes).
+ *
+ * tty       - 1 if stdout is a terminal; clearing and cursor movement are skipped otherwise
+ * colors    - 0 (no color), 8, 16, 256 or 16777216 (truecolor)
+ * sync      - 1 if synchronized updates (DEC mode 2026) are understood
+ * cur_color - foreground last emitted: 0-15, RLUTIL_RGB(r,g,b) or -1 if unknown
+ * seq       - pre-encoded foreground escape per color code, shortest form the terminal accepts
+ */
+typedef struct {
+	int tty;
+	int colors;
+	int sync;
+	int cur_color;
+	char seq[16][12];
+} TermCaps;
+
+/// Define: RLUTIL_RGB
+/// Packs a 24-bit color so it can be told apart from the 16 color codes.
+#define RLUTIL_RGB(r, g, b) (0x1000000 | ((r) << 16) | ((g) << 8) | (b))
+
+/// Function: encodeColorSeqs
+/// Rebuilds the per-color escape cache in caps for caps->colors.
+/// 16+ color terminals get the 5-byte SGR 30-37 / 90-97 forms, which never
+/// touch bold; 8-color terminals keep the legacy bold/normal pairs.
+RLUTIL_INLINE void encodeColorSeqs(TermCaps *caps) {
+	static const int ansi_index[8] = {0, 4, 2, 6, 1, 5, 3, 7}; // QBasic order -> SGR order
+	int c;
+	for (c = 0; c < 16; c++) {
+		int idx = ansi_index[c & 7], bright = c >= 8;
+		if (caps->colors <= 0) caps->seq[c][0] = 0;
+		else if (caps->colors < 16) sprintf(caps->seq[c], "\033[%s;3%dm", bright ? "01" : "22", idx);
+		else sprintf(caps->seq[c], "\033[%dm", (bright ? 90 : 30) + idx);
+	}
+	caps->cur_color = -1;
+}
+
+/// Function: termCaps
+/// Returns the process-wide <TermCaps>.
+RLUTIL_INLINE TermCaps *termCaps(void) {
+	static TermCaps caps;
+	static char initialized = 0; // bool
+	if (!initialized) {
+		caps.tty = 1;
+		caps.colors = 8;
+		caps.sync = 0;
+		encodeColorSeqs(&caps);
+		initialized = 1;
+	}
+	return &caps;
+}
+
+/// Function: getColorRGB
+/// Nominal (VGA) RGB value of color code c, used to match colors across depths.
+RLUTIL_INLINE void getColorRGB(int c, unsigned char rgb[3]) {
+	static const unsigned char palette[16][3] = {
+		{  0,   0,   0}, {  0,   0, 170}, {  0, 170,   0}, {  0, 170, 170},
+		{170,   0,   0}, {170,   0, 170}, {170,  85,   0}, {170, 170, 170},
+		{ 85,  85,  85}, { 85,  85, 255}, { 85, 255,  85}, { 85, 255, 255},
+		{255,  85,  85}, {255,  85, 255}, {255, 255,  85}, {255, 255, 255}
+	};
+	c &= 15;
+	rgb[0] = palette[c][0];
+	rgb[1] = palette[c][1];
+	rgb[2] = palette[c][2];
+}
+
+/// Function: nextColorSeq
+/// Returns the escape that switches the foreground to color c, or "" when
+/// c is already the current color or the terminal has no color.
+///
+/// See <Color Codes>
+RLUTIL_INLINE const char *nextColorSeq(int c) {
+	TermCaps *caps = termCaps();
+	if (c < 0 || c > 15 || c == caps->cur_color) return "";
+	caps->cur_color = c;
+	return caps->seq[c];
+}
+
+/// Function: formatColorRGB
+/// Writes the shortest escape for foreground r,g,b the terminal can show into
+/// buf (at least 24 bytes) and returns its length: truecolor as is, otherwise
+/// the nearest 256-color cube/grey entry, otherwise the nearest color code.
+/// Writes nothing when the color is already current.
+RLUTIL_INLINE int formatColorRGB(char *buf, int r, int g, int b) {
+	TermCaps *caps = termCaps();
+	buf[0] = 0;
+	if (caps->colors <= 0) return 0;
+	if (caps->colors >= 16777216) {
+		int key = RLUTIL_RGB(r, g, b);
+		if (key == caps->cur_color) return 0;
+		caps->cur_color = key;
+		return sprintf(buf, "\033[38;2;%d;%d;%dm", r, g, b);
+	}
+	if (caps->colors >= 256) {
+		// 6x6x6 cube levels 0,95,135,175,215,255 vs the 24-step grey ramp
+		int ri = r < 48 ? 0 : r < 115 ? 1 : (r - 35) / 40;
+		int gi = g < 48 ? 0 : g < 115 ? 1 : (g - 35) / 40;
+		int bi = b < 48 ? 0 : b < 115 ? 1 : (b - 35) / 40;
+		int lv[6] = {0, 95, 135, 175, 215, 255};
+		int cr = lv[ri], cg = lv[gi], cb = lv[bi];
+		int grey = (r + g + b) / 3;
+		int gidx = grey < 3 ? 0 : grey > 238 ? 23 : (grey - 3) / 10;
+		int gv = 8 + gidx * 10;
+		long dcube = (long)(r-cr)*(r-cr) + (long)(g-cg)*(g-cg) + (long)(b-cb)*(b-cb);
+		long dgrey = (long)(r-gv)*(r-gv) + (long)(g-gv)*(g-gv) + (long)(b-gv)*(b-gv);
+		int n = dgrey < dcube ? 232 + gidx : 16 + 36 * ri + 6 * gi + bi;
+		int key = RLUTIL_RGB(r, g, b);
+		if (key == caps->cur_color) return 0;
+		caps->cur_color = key;
+		return sprintf(buf, "\033[38;5;%dm", n);
+	}
+	{
+		int best = 0, c;
+		long bestd = -1;
+		for (c = 0; c < 16; c++) {
+			unsigned char p[3];
+			long d;
+			if (caps->colors < 16 && c == DARKGREY) continue; // bold black is unreadable on 8 colors
+			getColorRGB(c, p);
+			d = (long)(r-p[0])*(r-p[0]) + (long)(g-p[1])*(g-p[1]) + (long)(b-p[2])*(b-p[2]);
+			if (bestd < 0 || d < bestd) { bestd = d; best = c; }
+		}
+		const char *s = nextColorSeq(best);
+		strcpy(buf, s);
+		return (int)strlen(buf);
+	}
+}
+
 /// Function: setColor
 /// Change color specified by number (Windows / QBasic colors).
 /// Don't change the background color
@@ -465,7 +610,21 @@ RLUTIL_INLINE void setColor(int c) {
 
 	SetConsoleTextAttribute(hConsole, (csbi.wAttributes & 0xFFF0) | (WORD)c); // Foreground colors take up the least significant byte
 #else
-	RLUTIL_PRINT(getANSIColor(c));
+	const char *seq = nextColorSeq(c);
+	if (*seq) RLUTIL_PRINT(seq);
+#endif
+}
+
+/// Function: setColorRGB
+/// Change the foreground to a 24-bit color, degraded to what the terminal shows.
+///
+/// See <formatColorRGB>
+RLUTIL_INLINE void setColorRGB(int r, int g, int b) {
+#if defined(_WIN32) && !defined(RLUTIL_USE_ANSI)
+	(void)r; (void)g; (void)b;
+#else
+	char buf[32];
+	if (formatColorRGB(buf, r, g, b)) RLUTIL_PRINT(buf);
 #endif
 }
 
@@ -521,7 +680,8 @@ RLUTIL_INLINE void resetColor(void) {
 #if defined(_WIN32) && !defined(RLUTIL_USE_ANSI)
 	SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), (WORD)saveDefaultColor());
 #else
-	RLUTIL_PRINT(ANSI_ATTRIBUTE_RESET);
+	termCaps()->cur_color = -1;
+	if (termCaps()->colors > 0) RLUTIL_PRINT(ANSI_ATTRIBUTE_RESET);
 #endif
 }
 
@@ -544,6 +704,7 @@ RLUTIL_INLINE void cls(void) {
 
 	SetConsoleCursorPosition(hConsole, coordScreen);
 #else
+	if (!termCaps()->tty) return;
 	RLUTIL_PRINT(ANSI_CLS);
 	RLUTIL_PRINT(ANSI_CURSOR_HOME);
 #endif
@@ -559,6 +720,7 @@ RLUTIL_INLINE void locate(int x, int y) {
 	coord.Y = (SHORT)(y - 1); // Windows uses 0-based coordinates
 	SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), coord);
 #else // _WIN32 || USE_ANSI
+	if (!termCaps()->tty) return;
 	#ifdef __cplusplus
 		RLUTIL_PRINT("\033[" << y << ";" << x << "H");
 	#else // __cplusplus
@@ -569,6 +731,239 @@ RLUTIL_INLINE void locate(int x, int y) {
 #endif // _WIN32 || USE_ANSI
 }
 
+/// Function: enterAltScreen
+/// Switches to the alternate screen buffer, leaving the user's scrollback alone.
+/// No-op on Windows without ANSI.
+RLUTIL_INLINE void enterAltScreen(void) {
+#if !defined(_WIN32) || defined(RLUTIL_USE_ANSI)
+	if (!termCaps()->tty) return;
+	RLUTIL_PRINT(ANSI_ALT_SCREEN_ON);
+#endif
+}
+
+/// Function: leaveAltScreen
+/// Switches back to the normal screen buffer.
+RLUTIL_INLINE void leaveAltScreen(void) {
+#if !defined(_WIN32) || defined(RLUTIL_USE_ANSI)
+	if (!termCaps()->tty) return;
+	RLUTIL_PRINT(ANSI_ALT_SCREEN_OFF);
+#endif
+}
+
+/// Function: beginSyncUpdate
+/// Starts a synchronized update: the terminal holds back output until
+/// <endSyncUpdate>, so a frame is presented at once instead of torn.
+/// Terminals that do not know DEC mode 2026 ignore it.
+RLUTIL_INLINE void beginSyncUpdate(void) {
+#if !defined(_WIN32) || defined(RLUTIL_USE_ANSI)
+	if (!termCaps()->tty) return;
+	RLUTIL_PRINT(ANSI_SYNC_BEGIN);
+#endif
+}
+
+/// Function: endSyncUpdate
+/// Ends a synchronized update started with <beginSyncUpdate>.
+RLUTIL_INLINE void endSyncUpdate(void) {
+#if !defined(_WIN32) || defined(RLUTIL_USE_ANSI)
+	if (!termCaps()->tty) return;
+	RLUTIL_PRINT(ANSI_SYNC_END);
+#endif
+}
+
+/// Function: setScrollRegion
+/// Limits scrolling to the 1-based rows top..bottom (inclusive).
+/// Note: the cursor moves home afterwards.
+RLUTIL_INLINE void setScrollRegion(int top, int bottom) {
+#if !defined(_WIN32) || defined(RLUTIL_USE_ANSI)
+	if (!termCaps()->tty) return;
+	#ifdef __cplusplus
+		RLUTIL_PRINT("\033[" << top << ";" << bottom << "r");
+	#else // __cplusplus
+		char buf[32];
+		sprintf(buf, "\033[%d;%dr", top, bottom);
+		RLUTIL_PRINT(buf);
+	#endif // __cplusplus
+#endif
+}
+
+/// Function: resetScrollRegion
+/// Lets the whole screen scroll again.
+RLUTIL_INLINE void resetScrollRegion(void) {
+#if !defined(_WIN32) || defined(RLUTIL_USE_ANSI)
+	if (!termCaps()->tty) return;
+	RLUTIL_PRINT(ANSI_SCROLL_REGION_RESET);
+#endif
+}
+
+/// Function: insertLines
+/// Inserts n blank lines at the cursor row, pushing the rows below it down
+/// within the scroll region. Rows pushed past the region bottom are lost.
+RLUTIL_INLINE void insertLines(int n) {
+#if !defined(_WIN32) || defined(RLUTIL_USE_ANSI)
+	if (!termCaps()->tty) return;
+	#ifdef __cplusplus
+		RLUTIL_PRINT("\033[" << n << "L");
+	#else // __cplusplus
+		char buf[32];
+		sprintf(buf, "\033[%dL", n);
+		RLUTIL_PRINT(buf);
+	#endif // __cplusplus
+#endif
+}
+
+/// Function: querySyncUpdate
+/// Asks the terminal whether it supports synchronized updates (DEC mode 2026)
+/// and returns 1 if so. Sends DECRQM followed by a primary DA request, which
+/// every terminal answers, so the wait ends as soon as the DA reply arrives
+/// and at most after timeout_ms. Whatever else is pending on stdin by then is
+/// discarded so a reply cut off mid-sequence is not read as keystrokes.
+/// Returns 0 when stdin/stdout are not terminals.
+RLUTIL_INLINE int querySyncUpdate(int timeout_ms) {
+#ifdef _WIN32
+	(void)timeout_ms;
+	return 0;
+#else
+	struct termios oldt, newt;
+	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) return 0;
+	if (tcgetattr(STDIN_FILENO, &oldt) != 0) return 0;
+	newt = oldt;
+	newt.c_lflag &= ~(ICANON | ECHO);
+	newt.c_cc[VMIN]  = 0;
+	newt.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	fflush(stdout);
+	const char query[] = "\033[?2026$p\033[c";
+	if (write(STDOUT_FILENO, query, sizeof(query) - 1) < 0) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+		return 0;
+	}
+	char buf[256];
+	int len = 0, done = 0;
+	while (!done && len < (int)sizeof(buf) - 1) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(STDIN_FILENO, &fds);
+		struct timeval tv;
+		tv.tv_sec  = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		if (select(STDIN_FILENO+1, &fds, NULL, NULL, &tv) <= 0) break;
+		int n = (int)read(STDIN_FILENO, buf + len, sizeof(buf) - 1 - len);
+		if (n <= 0) break;
+		len += n;
+		buf[len] = 0;
+		// DA reply: ESC [ ? <digits and ;> c
+		for (const char *p = strstr(buf, "\033[?"); p && !done; p = strstr(p + 1, "\033[?")) {
+			const char *q = p + 3;
+			while ((*q >= '0' && *q <= '9') || *q == ';') q++;
+			if (*q == 'c') done = 1;
+		}
+	}
+	buf[len] = 0;
+	tcflush(STDIN_FILENO, TCIFLUSH);
+	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+	// DECRPM reply: ESC [ ? 2026 ; Ps $ y with Ps 1 = set, 2 = reset, 3 = permanently set
+	const char *r = strstr(buf, "\033[?2026;");
+	return r && r[8] >= '1' && r[8] <= '3';
+#endif
+}
+
+/// Function: terminfoColors
+/// Looks TERM's compiled terminfo entry up in the usual places and returns its
+/// "colors" capability, or -1 if there is no entry or it has none.
+RLUTIL_INLINE int terminfoColors(const char *term) {
+#ifdef _WIN32
+	(void)term;
+	return -1;
+#else
+	const char *home = getenv("HOME");
+	const char *env_dir = getenv("TERMINFO");
+	const char *env_dirs = getenv("TERMINFO_DIRS");
+	const char *dirs[8];
+	char home_dir[512], list[1024], path[1024];
+	int ndirs = 0, d;
+	if (!term || !*term || strchr(term, '/')) return -1;
+	if (env_dir) dirs[ndirs++] = env_dir;
+	if (home) { snprintf(home_dir, sizeof(home_dir), "%s/.terminfo", home); dirs[ndirs++] = home_dir; }
+	list[0] = 0;
+	if (env_dirs) { snprintf(list, sizeof(list), "%s", env_dirs); }
+	{
+		char *tok = strtok(list, ":");
+		while (tok && ndirs < 4) { if (*tok) dirs[ndirs++] = tok; tok = strtok(NULL, ":"); }
+	}
+	dirs[ndirs++] = "/etc/terminfo";
+	dirs[ndirs++] = "/lib/terminfo";
+	dirs[ndirs++] = "/usr/share/terminfo";
+	dirs[ndirs++] = "/usr/lib/terminfo";
+	for (d = 0; d < ndirs; d++) {
+		int layout;
+		for (layout = 0; layout < 2; layout++) {
+			unsigned char buf[4096];
+			int fd, len, hdr[6], i, numsize, off;
+			if (layout == 0) snprintf(path, sizeof(path), "%s/%c/%s", dirs[d], term[0], term);
+			else snprintf(path, sizeof(path), "%s/%02x/%s", dirs[d], (unsigned char)term[0], term); // macOS
+			fd = open(path, O_RDONLY);
+			if (fd < 0) continue;
+			len = (int)read(fd, buf, sizeof(buf));
+			close(fd);
+			if (len < 12) continue;
+			for (i = 0; i < 6; i++) hdr[i] = (short)(buf[2*i] | (buf[2*i+1] << 8));
+			if (hdr[0] == 0432) numsize = 2;       // legacy format
+			else if (hdr[0] == 01036) numsize = 4; // 32-bit numbers (ncurses 6.1+)
+			else continue;
+			if (hdr[3] <= 13) return -1; // no "colors" slot (numeric #13)
+			off = 12 + hdr[1] + hdr[2];
+			off += off & 1; // numbers start on an even offset
+			off += 13 * numsize;
+			if (off + numsize > len) continue;
+			if (numsize == 2) return (short)(buf[off] | (buf[off+1] << 8));
+			return (int)(buf[off] | (buf[off+1] << 8) | (buf[off+2] << 16) | ((unsigned)buf[off+3] << 24));
+		}
+	}
+	return -1;
+#endif
+}
+
+/// Function: detectTermCaps
+/// Probes the terminal once: whether stdout is a terminal at all, NO_COLOR,
+/// COLORTERM, TERM and its terminfo "colors", and synchronized update support.
+/// Pipes and files get tty = 0 and colors = 0, so output is plain glyphs.
+/// Returns the updated <TermCaps>.
+RLUTIL_INLINE TermCaps *detectTermCaps(void) {
+	TermCaps *caps = termCaps();
+	const char *term = getenv("TERM");
+	const char *colorterm = getenv("COLORTERM");
+	int colors;
+#ifdef _WIN32
+	DWORD mode = 0;
+	HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+	caps->tty = GetConsoleMode(hOut, &mode) ? 1 : 0;
+	#ifdef RLUTIL_USE_ANSI
+	// 0x0004 = ENABLE_VIRTUAL_TERMINAL_PROCESSING (Windows 10+)
+	if (caps->tty && !SetConsoleMode(hOut, mode | 0x0004)) caps->tty = 0;
+	#endif
+	colors = caps->tty ? 16 : 0;
+#else
+	caps->tty = isatty(STDOUT_FILENO) && !(term && strcmp(term, "dumb") == 0);
+	colors = 8;
+	if (term) {
+		int ti = terminfoColors(term);
+		if (ti > 0) colors = ti;
+		else if (strstr(term, "256color")) colors = 256;
+		else if (strstr(term, "xterm") || strstr(term, "screen") || strstr(term, "tmux") ||
+		         strstr(term, "rxvt") || strstr(term, "linux") || strstr(term, "konsole")) colors = 16;
+		if (strstr(term, "direct") || strstr(term, "truecolor")) colors = 16777216;
+	}
+	if (!caps->tty) colors = 0;
+#endif
+	if (colors > 0 && colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0))
+		colors = 16777216;
+	if (getenv("NO_COLOR") && *getenv("NO_COLOR")) colors = 0;
+	caps->colors = colors > 256 && colors < 16777216 ? 256 : colors;
+	caps->sync = caps->tty ? querySyncUpdate(100) : 0;
+	encodeColorSeqs(caps);
+	return caps;
+}
+
 /// Function: setString
 /// Prints the supplied string without advancing the cursor
 #ifdef __cplusplus
@@ -615,6 +1010,7 @@ RLUTIL_INLINE void setCursorVisibility(char visible) {
 	structCursorInfo.bVisible = (visible ? TRUE : FALSE);
 	SetConsoleCursorInfo( hConsoleOutput, &structCursorInfo );
 #else // _WIN32 || USE_ANSI
+	if (!termCaps()->tty) return;
 	RLUTIL_PRINT((visible ? ANSI_CURSOR_SHOW : ANSI_CURSOR_HIDE));
 #endif // _WIN32 || USE_ANSI
 }